@@ -0,0 +1,56 @@
+#!/usr/bin/awk -f
+#
+# Creates the list of used interrupt sources for the shared ISRs.
+#
+# The given C files are searched for assignments of callback functions
+# to the hsk_isr* structs, e.g.:
+#
+#	hsk_isr9.EXINT3 = &hsk_pwc_isr_cc0_p30;
+#
+# For every interrupt source a callback is assigned to, a define in the
+# format ISRn_SOURCE is printed, e.g. ISR9_EXINT3.
+#
+# The output is a C header meant to be stored as \c isr_sources.h in an
+# include directory, see the \c isr target of the \c Makefile:
+#
+#	awk -f scripts/isr.awk src/*/*.c > gen/isr_sources.h
+#
+# All files that can register a callback must be listed, including the
+# files of depending projects. Sources that are not listed are never
+# called back, if \c ISR_SOURCES is defined at build time.
+#
+
+BEGIN {
+	print "/*"
+	print " * List of used interrupt sources, generated by isr.awk."
+	print " */"
+	print ""
+	print "#ifndef _ISR_SOURCES_H_"
+	print "#define _ISR_SOURCES_H_"
+	print ""
+}
+
+#
+# Collect assignments to callback pointers, comparisons are ignored.
+#
+{
+	line = $0
+	while (match(line, /hsk_isr[0-9]+\.[A-Za-z0-9_]+[ \t]*=[^=]/)) {
+		source = substr(line, RSTART + 7, RLENGTH - 7)
+		sub(/[ \t]*=.*/, "", source)
+		sub(/\./, "_", source)
+		if (!(source in SOURCES)) {
+			SOURCES[source]
+			ORDER[COUNT++] = source
+		}
+		line = substr(line, RSTART + RLENGTH)
+	}
+}
+
+END {
+	for (i = 0; i < COUNT; i++) {
+		print "#define ISR" ORDER[i]
+	}
+	print ""
+	print "#endif /* _ISR_SOURCES_H_ */"
+}
@@ -19,6 +19,7 @@
 #include <string.h> /* memset() */
 
 #include "../hsk_isr/hsk_isr.h"
+#include "../hsk_mdu/hsk_mdu.h"
 
 /**
  * Conversion clock prescaler setting for 12MHz.
@@ -225,7 +226,8 @@ void hsk_adc_init(ubyte resolution, uword __xdata convTime) {
 		stc = (convTime - 1) / 2 - 3 - resolution;
 	} else if (convTime <= 1 + 3 * (258 + resolution)) {
 		ctc = ADC_CLK_8MHz;
-		stc = (convTime - 1) / 3 - 3 - resolution;
+		MDU_DIV16(stc, convTime - 1, 3);
+		stc -= 3 + resolution;
 	} else if (convTime <= 1 + 4 * (258 + resolution)) {
 		ctc = ADC_CLK_6MHz;
 		stc = (convTime - 1) / 4 - 3 - resolution;
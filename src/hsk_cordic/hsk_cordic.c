@@ -0,0 +1,320 @@
+/** \file
+ * HSK CORDIC Coprocessor implementation
+ *
+ * This file implements the functions defined in hsk_cordic.h.
+ *
+ * The CORDIC coprocessor only converges for angles within about
+ * \f$ \pm 99.9^\circ \f$. Inputs outside of this range are rotated by
+ * \f$ \pi \f$ before starting a calculation, which is achieved by
+ * negating the vector and adding \f$ \pi \f$ to the angle.
+ *
+ * The gain compensation is performed before starting a calculation,
+ * so that the interrupt only has to copy the results.
+ *
+ * @author kami
+ */
+
+#include <Infineon/XC878.h>
+
+#include "hsk_cordic.h"
+
+#include "../hsk_isr/hsk_isr.h"
+#include "../hsk_mdu/hsk_mdu.h"
+
+/*
+ * SDCC does not like the code keyword for function pointers, C51 needs it
+ * or it will use generic pointers.
+ */
+#ifdef SDCC
+	#undef code
+	#define code
+#endif /* SDCC */
+
+/*
+ * C51 does not include the used register bank in pointer types.
+ */
+#ifdef __C51__
+	#define using(bank)
+#endif
+
+/**
+ * The inverse of the CORDIC gain \f$ 1/K \f$ in units of \f$ 2^{-15} \f$.
+ */
+#define CORDIC_GAIN_INV        19898
+
+/**
+ * CD_CON Start Calculation bit.
+ */
+#define BIT_ST                 0
+
+/**
+ * CD_CON Start Calculation Mode bit.
+ */
+#define BIT_ST_MODE            1
+
+/**
+ * CD_CON Rotation/Vectoring Mode Select bit.
+ */
+#define BIT_ROTVEC             2
+
+/**
+ * CD_CON Operating Mode bits.
+ */
+#define BIT_MODE               3
+
+/**
+ * MODE bit count.
+ */
+#define CNT_MODE               2
+
+/**
+ * CD_CON X and Y Magnitude Prescaler bits.
+ */
+#define BIT_MPS                6
+
+/**
+ * MPS bit count.
+ */
+#define CNT_MPS                2
+
+/**
+ * CD_STATC Interrupt Enable bit.
+ */
+#define BIT_INT_EN             3
+
+/**
+ * Circular operating mode.
+ */
+#define CORDIC_MODE_CIRCULAR   1
+
+/**
+ * Do not prescale the X and Y results.
+ */
+#define CORDIC_MPS_1           0
+
+/**
+ * CD_CON setting for a rotation, started by setting ST.
+ */
+#define CORDIC_CON_ROTATE      ((1 << BIT_ST_MODE) | (1 << BIT_ROTVEC) \
+                                | (CORDIC_MODE_CIRCULAR << BIT_MODE) \
+                                | (CORDIC_MPS_1 << BIT_MPS))
+
+/**
+ * CD_CON setting for vectoring, started by setting ST.
+ */
+#define CORDIC_CON_VECTOR      ((1 << BIT_ST_MODE) \
+                                | (CORDIC_MODE_CIRCULAR << BIT_MODE) \
+                                | (CORDIC_MPS_1 << BIT_MPS))
+
+/** \var cordic
+ * Runtime information for background calculations.
+ */
+static volatile struct {
+	/**
+	 * The struct to deliver the results to.
+	 */
+	struct hsk_cordic_data * ptr;
+
+	/**
+	 * A callback function pointer called upon completion.
+	 */
+	void (code *callback)(void) using(1);
+
+	/**
+	 * Set while a background calculation is in progress.
+	 */
+	ubyte busy;
+} pdata cordic;
+
+/**
+ * PMCON1 CORDIC Disable Request bit.
+ */
+#define BIT_CDC_DIS            6
+
+void hsk_cordic_enable(void) {
+	/* Enable clock. */
+	SFR_PAGE(_su1, noSST);
+	PMCON1 &= ~(1 << BIT_CDC_DIS);
+	SFR_PAGE(_su0, noSST);
+}
+
+void hsk_cordic_disable(void) {
+	/* Wait for background calculations. */
+	while (cordic.busy);
+	/* Stop clock in module. */
+	SFR_PAGE(_su1, noSST);
+	PMCON1 |= 1 << BIT_CDC_DIS;
+	SFR_PAGE(_su0, noSST);
+}
+
+#pragma save
+#ifdef SDCC
+#pragma nooverlay
+#endif
+/**
+ * Delivers the results of a background calculation and calls the
+ * callback function.
+ *
+ * @private
+ */
+void hsk_cordic_isr_eoc(void) using 1 {
+	int idata x, y, z;
+
+	SET_RMAP();
+	EOC = 0;
+	/* Blocking calculations also raise EOC, ignore them. */
+	if (!cordic.busy) {
+		RESET_RMAP();
+		return;
+	}
+	INT_EN = 0;
+	x = CD_CORDXLH;
+	y = CD_CORDYLH;
+	z = CD_CORDZLH;
+	RESET_RMAP();
+
+	cordic.ptr->x = x;
+	cordic.ptr->y = y;
+	cordic.ptr->z = z;
+	cordic.busy = 0;
+	if (cordic.callback) {
+		cordic.callback();
+	}
+}
+#pragma restore
+
+/**
+ * Compensates the CORDIC gain by scaling a value with \f$ 1/K \f$.
+ *
+ * @param value
+ *	The value to scale
+ * @return
+ *	The scaled value, rounded to the nearest integer
+ * @private
+ */
+int hsk_cordic_scale(int value) {
+	bool neg = value < 0;
+	ulong product;
+
+	MDU_MUL(product, neg ? -value : value, CORDIC_GAIN_INV);
+	value = (product + (1ul << 14)) >> 15;
+	return neg ? -value : value;
+}
+
+/**
+ * Performs range reduction and gain compensation and starts a
+ * calculation.
+ *
+ * @param values
+ *	The input data
+ * @param con
+ *	The CD_CON setting, CORDIC_CON_ROTATE or CORDIC_CON_VECTOR
+ * @param statc
+ *	The CD_STATC setting, activates the interrupt
+ * @private
+ */
+void hsk_cordic_start(const struct hsk_cordic_data * const values,
+                      const ubyte con, const ubyte statc) {
+	int x = values->x;
+	int y = values->y;
+	int z = values->z;
+
+	/* Rotate by pi if the calculation would not converge. */
+	if (con & (1 << BIT_ROTVEC) ?
+	    z >= CORDIC_PI_2 || z < -CORDIC_PI_2 :
+	    x < 0) {
+		x = -x;
+		y = -y;
+		z = (uword)z + (uword)CORDIC_PI;
+	}
+
+	/* Compensate the gain. */
+	x = hsk_cordic_scale(x);
+	y = hsk_cordic_scale(y);
+
+	SET_RMAP();
+	CD_CON = con;
+	CD_STATC = statc;
+	CD_CORDXLH = x;
+	CD_CORDYLH = y;
+	CD_CORDZLH = z;
+	CD_CON = con | (1 << BIT_ST);
+	RESET_RMAP();
+}
+
+/**
+ * Runs a blocking calculation.
+ *
+ * @param values
+ *	The input data, results are returned in the same struct
+ * @param con
+ *	The CD_CON setting, CORDIC_CON_ROTATE or CORDIC_CON_VECTOR
+ * @private
+ */
+void hsk_cordic_run(struct hsk_cordic_data * const values, const ubyte con) {
+	/* Wait for background calculations. */
+	while (cordic.busy);
+
+	hsk_cordic_start(values, con, 0);
+
+	SET_RMAP();
+	while (CD_BSY);
+	values->x = CD_CORDXLH;
+	values->y = CD_CORDYLH;
+	values->z = CD_CORDZLH;
+	EOC = 0;
+	RESET_RMAP();
+}
+
+void hsk_cordic_rotate(struct hsk_cordic_data * const values) {
+	hsk_cordic_run(values, CORDIC_CON_ROTATE);
+}
+
+void hsk_cordic_vector(struct hsk_cordic_data * const values) {
+	hsk_cordic_run(values, CORDIC_CON_VECTOR);
+}
+
+/**
+ * Starts a background calculation.
+ *
+ * @param values
+ *	The input data, results are returned in the same struct
+ * @param con
+ *	The CD_CON setting, CORDIC_CON_ROTATE or CORDIC_CON_VECTOR
+ * @param callback
+ *	A function pointer to a callback function, may be 0
+ * @private
+ */
+void hsk_cordic_runAsync(struct hsk_cordic_data * const values,
+                         const ubyte con,
+                         const void (code * const __xdata callback)
+                                    (void) using(1)) {
+	/* Wait for background calculations. */
+	while (cordic.busy);
+
+	cordic.ptr = values;
+	cordic.callback = callback;
+	cordic.busy = 1;
+
+	/* Register the interrupt callback. */
+	hsk_isr8.EOC = &hsk_cordic_isr_eoc;
+	EX2 = 1;
+
+	hsk_cordic_start(values, con, 1 << BIT_INT_EN);
+}
+
+void hsk_cordic_rotateAsync(struct hsk_cordic_data * const values,
+                            const void (code * const __xdata callback)
+                                       (void) using(1)) {
+	hsk_cordic_runAsync(values, CORDIC_CON_ROTATE, callback);
+}
+
+void hsk_cordic_vectorAsync(struct hsk_cordic_data * const values,
+                            const void (code * const __xdata callback)
+                                       (void) using(1)) {
+	hsk_cordic_runAsync(values, CORDIC_CON_VECTOR, callback);
+}
+
+bool hsk_cordic_busy(void) {
+	return cordic.busy;
+}
@@ -0,0 +1,185 @@
+/** \file
+ * HSK CORDIC Coprocessor headers
+ *
+ * This file contains function prototypes to perform trigonometric
+ * calculations with the XC878 CORDIC coprocessor.
+ *
+ * The library uses the circular CORDIC mode. Rotation mode rotates a
+ * vector by an angle, which yields sine and cosine. Vectoring mode rotates
+ * a vector onto the x axis, which yields its magnitude and angle, i.e.
+ * \f$ \sqrt{x^2 + y^2} \f$ and \f$ atan2(y, x) \f$.
+ *
+ * The CORDIC algorithm inherently scales vectors by the gain
+ * \f$ K \approx 1.64676 \f$. The library compensates the gain by scaling
+ * the input vector by \f$ 1/K \f$, so results can be used without further
+ * correction.
+ *
+ * All values are signed 16 bit integers. Angles are represented in units
+ * of \f$ \pi / 2^{15} \f$ rad, i.e. a full circle covers the entire
+ * 16 bit range from -32768 (\f$ -\pi \f$) to 32767
+ * (\f$ \pi - \pi / 2^{15} \f$). This way angles wrap around naturally.
+ *
+ * The magnitude of input vectors must not exceed 32767. The error of
+ * returned vector components and magnitudes is in the range of a few LSB,
+ * mostly caused by the gain compensation. Returned angles are accurate
+ * to about \f$ 2^{-15} \pi \f$.
+ *
+ * Calculations can either be run blocking, or be started in the background.
+ * A background calculation delivers its results to the given data struct
+ * and calls a callback function from the EOC interrupt. Only one
+ * calculation can be run at any time.
+ *
+ * @author kami
+ */
+
+#ifndef _HSK_CORDIC_H_
+#define _HSK_CORDIC_H_
+
+/*
+ * Required for SDCC to propagate ISR prototypes.
+ */
+#ifdef SDCC
+#include "../hsk_isr/hsk_isr.isr"
+#endif /* SDCC */
+
+/*
+ * C51 does not include the used register bank in pointer types.
+ */
+#ifdef __C51__
+	#define using(bank)
+#endif
+
+/*
+ * SDCC does not like the \c code keyword for function pointers, C51 needs it
+ * or it will use generic pointers.
+ */
+#ifdef SDCC
+	#undef code
+	#define code
+#endif /* SDCC */
+
+/**
+ * The angle \f$ \pi \f$ is not representable, this is the representation
+ * of \f$ -\pi \f$.
+ */
+#define CORDIC_PI            (-32767 - 1)
+
+/**
+ * The representation of \f$ \pi / 2 \f$.
+ */
+#define CORDIC_PI_2          16384
+
+/**
+ * Holds the input and output values of a CORDIC calculation.
+ */
+struct hsk_cordic_data {
+	/**
+	 * The x component of the vector.
+	 */
+	int x;
+
+	/**
+	 * The y component of the vector.
+	 */
+	int y;
+
+	/**
+	 * The angle in units of \f$ \pi / 2^{15} \f$ rad.
+	 */
+	int z;
+};
+
+/**
+ * Turns on the CORDIC coprocessor.
+ */
+void hsk_cordic_enable(void);
+
+/**
+ * Turns off the CORDIC coprocessor to conserve power.
+ */
+void hsk_cordic_disable(void);
+
+/**
+ * Rotates the vector (x, y) by the angle z.
+ *
+ * On return x and y contain the rotated vector and z is 0. To get the
+ * sine and cosine of an angle with the amplitude a, call the function
+ * with x = a, y = 0.
+ *
+ * @param values
+ *	The vector and angle to rotate by, results are returned in the
+ *	same struct
+ */
+void hsk_cordic_rotate(struct hsk_cordic_data * const values);
+
+/**
+ * Rotates the vector (x, y) onto the x axis.
+ *
+ * On return x contains the magnitude of the vector, y is 0 and the
+ * angle of the vector, i.e. atan2(y, x) was added to z.
+ *
+ * @param values
+ *	The vector to measure, results are returned in the same struct
+ */
+void hsk_cordic_vector(struct hsk_cordic_data * const values);
+
+/**
+ * Starts the rotation of the vector (x, y) by the angle z in the
+ * background.
+ *
+ * This works like hsk_cordic_rotate(), but returns immediately. The
+ * struct must not be accessed until the calculation is complete.
+ *
+ * @param values
+ *	The vector and angle to rotate by, results are returned in the
+ *	same struct
+ * @param callback
+ *	A function pointer to a callback function, called upon completion
+ *	after the results have been written to the data struct, may be 0
+ */
+void hsk_cordic_rotateAsync(struct hsk_cordic_data * const values,
+                            const void (code * const __xdata callback)
+                                       (void) using(1));
+
+/**
+ * Starts rotating the vector (x, y) onto the x axis in the background.
+ *
+ * This works like hsk_cordic_vector(), but returns immediately. The
+ * struct must not be accessed until the calculation is complete.
+ *
+ * @param values
+ *	The vector to measure, results are returned in the same struct
+ * @param callback
+ *	A function pointer to a callback function, called upon completion
+ *	after the results have been written to the data struct, may be 0
+ */
+void hsk_cordic_vectorAsync(struct hsk_cordic_data * const values,
+                            const void (code * const __xdata callback)
+                                       (void) using(1));
+
+/**
+ * Returns whether a background calculation is in progress.
+ *
+ * @retval 1
+ *	A calculation is in progress
+ * @retval 0
+ *	The CORDIC is idle, results of the last calculation are available
+ */
+bool hsk_cordic_busy(void);
+
+/*
+ * Restore the usual meaning of \c code.
+ */
+#ifdef SDCC
+	#undef code
+	#define code	__code
+#endif /* SDCC */
+
+/*
+ * Restore the usual meaning of \c using(bank).
+ */
+#ifdef __C51__
+	#undef using
+#endif /* __C51__ */
+
+#endif /* _HSK_CORDIC_H_ */
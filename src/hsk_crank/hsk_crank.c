@@ -0,0 +1,491 @@
+/** \file
+ * HSK Crank Angle Tracking implementation
+ *
+ * This file implements the functions defined in hsk_crank.h.
+ *
+ * The tooth ISR and the compare ISR are both called back by the shared
+ * ISR 9, so they cannot interrupt each other and both can be blocked by
+ * EXM.
+ *
+ * @author kami
+ */
+
+#include <Infineon/XC878.h>
+
+#include "hsk_crank.h"
+
+#include <string.h> /* memset() */
+
+#include "../hsk_isr/hsk_isr.h"
+#include "../hsk_pwc/hsk_pwc.h"
+#include "../hsk_mdu/hsk_mdu.h"
+
+/*
+ * SDCC does not like the code keyword for function pointers, C51 needs it
+ * or it will use generic pointers.
+ */
+#ifdef SDCC
+	#undef code
+	#define code
+#endif /* SDCC */
+
+/*
+ * C51 does not include the used register bank in pointer types.
+ */
+#ifdef __C51__
+	#define using(bank)
+#endif
+
+/**
+ * The maximum number of missing teeth.
+ */
+#define MISSING_MAX          3
+
+/**
+ * T2CCU_CCEN Capture/Compare Enable bits start.
+ */
+#define BIT_CCM0             0
+
+/**
+ * CCMx bit count.
+ */
+#define CNT_CCMx             2
+
+/**
+ * T2CCU_CCEN compare mode selection.
+ */
+#define CCMx_COMPARE         2
+
+/**
+ * The number of CCT overflows without a tooth edge, after which the
+ * trigger wheel is considered stalled.
+ *
+ * A tooth edge is expected within every window time, two overflows
+ * guarantee that a full window time has passed.
+ */
+#define STALL_OVERFLOWS      2
+
+/** \var crank
+ * Trigger wheel tracking data.
+ */
+static volatile struct {
+	/**
+	 * The last captured tooth edge.
+	 */
+	uword lastCapture;
+
+	/**
+	 * The period of the last regular tooth.
+	 */
+	uword period;
+
+	/**
+	 * The angle of the scheduled event.
+	 */
+	uword target;
+
+	/**
+	 * The scheduled event callback function, 0 if no event is scheduled.
+	 */
+	void (code *callback)(void) using(1);
+
+	/**
+	 * The channel capturing tooth edges.
+	 */
+	hsk_pwc_channel channel;
+
+	/**
+	 * The channel used for scheduled events.
+	 */
+	hsk_pwc_channel compare;
+
+	/**
+	 * The number of tooth positions on the wheel.
+	 */
+	ubyte teeth;
+
+	/**
+	 * The number of missing teeth.
+	 */
+	ubyte missing;
+
+	/**
+	 * The tooth position of the last captured edge.
+	 */
+	ubyte tooth;
+
+	/**
+	 * Set while the tooth position is known.
+	 */
+	ubyte synced;
+
+	/**
+	 * The number of CCT overflows since the last tooth edge, up to
+	 * STALL_OVERFLOWS.
+	 */
+	ubyte overflows;
+} pdata crank;
+
+/**
+ * The CCT overflow callback function registered before the first
+ * hsk_crank_open() call, e.g. by hsk_pwc_init().
+ *
+ * This is kept outside of the crank struct, so it survives repeated
+ * calls of hsk_crank_open().
+ */
+static void (code * pdata cctOverflow)(void) using(1);
+
+/**
+ * Ends synchronization of a stalled trigger wheel.
+ *
+ * The last period is discarded as well, so the first tooth edge after
+ * the stall is not taken for the gap.
+ *
+ * @private
+ */
+#define CRANK_STALL() { \
+	crank.synced = 0; \
+	crank.period = 0; \
+}
+
+#pragma save
+#ifdef SDCC
+#pragma nooverlay
+#endif
+/**
+ * Calls the scheduled event callback function upon a compare match.
+ *
+ * The compare mode is turned off again, the event is armed once per
+ * revolution by hsk_crank_isr_tooth().
+ *
+ * @private
+ */
+void hsk_crank_isr_compare(void) using 1 {
+	SFR_PAGE(_t2_1, SST1);
+	T2CCU_CCEN &= ~(((1 << CNT_CCMx) - 1) << (crank.compare * CNT_CCMx + BIT_CCM0));
+	SFR_PAGE(_t2_1, RST1);
+
+	if (crank.callback) {
+		crank.callback();
+	}
+}
+
+/**
+ * Detects a stalled trigger wheel upon CCT overflows.
+ *
+ * The event is passed on to the callback function registered before
+ * hsk_crank_open().
+ *
+ * @private
+ */
+void hsk_crank_isr_cctOverflow(void) using 1 {
+	if (crank.overflows < STALL_OVERFLOWS
+	    && ++crank.overflows == STALL_OVERFLOWS) {
+		CRANK_STALL();
+	}
+
+	if (cctOverflow) {
+		cctOverflow();
+	}
+}
+
+/**
+ * Updates the tooth position with every captured tooth edge and arms
+ * the scheduled event.
+ *
+ * @private
+ */
+void hsk_crank_isr_tooth(void) using 1 {
+	uword idata capture;
+	uword idata period;
+	uword idata diff;
+	ulong idata ticks;
+	ubyte idata i;
+
+	/* Get the captured value. */
+	if (crank.channel == PWC_CC3) {
+		SFR_PAGE(_t2_3, SST1);
+		capture = T2CCU_CC3LH;
+		SFR_PAGE(_t2_3, RST1);
+	} else {
+		SFR_PAGE(_t2_2, SST1);
+		switch (crank.channel) {
+		case PWC_CC0:
+			capture = T2CCU_CC0LH;
+			break;
+		case PWC_CC1:
+			capture = T2CCU_CC1LH;
+			break;
+		default:
+			capture = T2CCU_CC2LH;
+			break;
+		}
+		SFR_PAGE(_t2_2, RST1);
+	}
+	period = capture - crank.lastCapture;
+	crank.lastCapture = capture;
+	crank.overflows = 0;
+
+	/*
+	 * Detect the gap, it is expected to last missing + 1 periods,
+	 * the detection threshold is missing + 1/2 periods.
+	 */
+	ticks = crank.period >> 1;
+	for (i = crank.missing; i; i--) {
+		ticks += crank.period;
+	}
+	if (crank.period && period > ticks) {
+		/* Synchronize, unless the gap was not expected. */
+		crank.synced = !crank.synced
+		               || crank.tooth == crank.teeth - crank.missing - 1;
+		crank.tooth = 0;
+	} else {
+		crank.period = period;
+		/* Lose synchronization if the gap was missed. */
+		if (++crank.tooth >= crank.teeth - crank.missing) {
+			crank.synced = 0;
+		}
+	}
+
+	/* Check for a scheduled event. */
+	if (!crank.synced || !crank.callback) {
+		return;
+	}
+
+	/* Get the distance to the event. */
+	diff = crank.target - ((uword)crank.tooth << 8);
+	if (crank.target < ((uword)crank.tooth << 8)) {
+		diff += (uword)crank.teeth << 8;
+	}
+	/* Get the distance to the next tooth edge. */
+	i = crank.tooth == crank.teeth - crank.missing - 1 ?
+	    crank.missing + 1 : 1;
+	/* Only arm events before the next tooth edge. */
+	if ((diff >> 8) >= i) {
+		return;
+	}
+
+	/* Convert the distance to timer ticks. */
+	ticks = 0;
+	for (i = 16; i; i--) {
+		ticks <<= 1;
+		if (diff & 0x8000) {
+			ticks += crank.period;
+		}
+		diff <<= 1;
+	}
+	diff = ticks >> 8;
+
+	/* Set the compare value. */
+	if (crank.compare == PWC_CC3) {
+		SFR_PAGE(_t2_3, SST1);
+		T2CCU_CC3LH = capture + diff;
+		SFR_PAGE(_t2_3, RST1);
+	} else {
+		SFR_PAGE(_t2_2, SST1);
+		switch (crank.compare) {
+		case PWC_CC0:
+			T2CCU_CC0LH = capture + diff;
+			break;
+		case PWC_CC1:
+			T2CCU_CC1LH = capture + diff;
+			break;
+		default:
+			T2CCU_CC2LH = capture + diff;
+			break;
+		}
+		SFR_PAGE(_t2_2, RST1);
+	}
+
+	/* Activate compare mode. */
+	SFR_PAGE(_t2_1, SST1);
+	T2CCU_CCEN = T2CCU_CCEN & ~(((1 << CNT_CCMx) - 1) << (crank.compare * CNT_CCMx + BIT_CCM0))
+	             | (CCMx_COMPARE << (crank.compare * CNT_CCMx + BIT_CCM0));
+	/* Check whether the compare value has already been passed. */
+	if ((uword)(T2CCU_CCTLH - capture) >= diff) {
+		T2CCU_CCEN &= ~(((1 << CNT_CCMx) - 1) << (crank.compare * CNT_CCMx + BIT_CCM0));
+		SFR_PAGE(_t2_1, RST1);
+		crank.callback();
+		return;
+	}
+	SFR_PAGE(_t2_1, RST1);
+}
+#pragma restore
+
+void hsk_crank_open(const hsk_pwc_port port, const ubyte edgeMode,
+                    const ubyte teeth, const ubyte missing,
+                    const hsk_pwc_channel compare) {
+	bool ea = EA;
+	bool exm = EXM;
+	bool et2 = ET2;
+	hsk_pwc_channel channel;
+
+	/*
+	 * Select the channel connected to the port.
+	 */
+	switch (port) {
+	case PWC_CC0_P30:
+	case PWC_CC0_P40:
+	case PWC_CC0_P55:
+		channel = PWC_CC0;
+		break;
+	case PWC_CC1_P32:
+	case PWC_CC1_P41:
+	case PWC_CC1_P56:
+		channel = PWC_CC1;
+		break;
+	case PWC_CC2_P33:
+	case PWC_CC2_P44:
+	case PWC_CC2_P52:
+		channel = PWC_CC2;
+		break;
+	case PWC_CC3_P34:
+	case PWC_CC3_P45:
+	case PWC_CC3_P57:
+		channel = PWC_CC3;
+		break;
+	default:
+		return;
+	}
+
+	/* Configure the tooth input and the compare channel time base. */
+	hsk_pwc_port_open(port, 1);
+	hsk_pwc_channel_edgeMode(channel, edgeMode);
+	hsk_pwc_channel_open(compare, 1);
+	hsk_pwc_channel_close(compare);
+
+	EA = 0;
+	EXM = 0;
+	ET2 = 0;
+	EA = ea;
+
+	memset(&crank, 0, sizeof(crank));
+	crank.channel = channel;
+	crank.compare = compare;
+	crank.teeth = teeth;
+	crank.missing = missing < 1 ? 1 : missing > MISSING_MAX ? MISSING_MAX : missing;
+
+	/* Take over the capture interrupt. */
+	switch (channel) {
+	case PWC_CC0:
+		hsk_isr9.EXINT3 = &hsk_crank_isr_tooth;
+		break;
+	case PWC_CC1:
+		hsk_isr9.EXINT4 = &hsk_crank_isr_tooth;
+		break;
+	case PWC_CC2:
+		hsk_isr9.EXINT5 = &hsk_crank_isr_tooth;
+		break;
+	case PWC_CC3:
+		hsk_isr9.EXINT6 = &hsk_crank_isr_tooth;
+		break;
+	}
+
+	/* Register the compare interrupt. */
+	switch (compare) {
+	case PWC_CC0:
+		hsk_isr9.EXINT3 = &hsk_crank_isr_compare;
+		break;
+	case PWC_CC1:
+		hsk_isr9.EXINT4 = &hsk_crank_isr_compare;
+		break;
+	case PWC_CC2:
+		hsk_isr9.EXINT5 = &hsk_crank_isr_compare;
+		break;
+	case PWC_CC3:
+		hsk_isr9.EXINT6 = &hsk_crank_isr_compare;
+		break;
+	}
+
+	/* Watch the CCT overflows for stalls, unless already chained in
+	 * by a previous call. */
+	if (hsk_isr5.CCTOVF != &hsk_crank_isr_cctOverflow) {
+		cctOverflow = hsk_isr5.CCTOVF;
+		hsk_isr5.CCTOVF = &hsk_crank_isr_cctOverflow;
+	}
+
+	EA = 0;
+	EXM = exm;
+	ET2 = et2;
+	EA = ea;
+}
+
+uword hsk_crank_getAngle(void) {
+	bool ea = EA;
+	bool exm = EXM;
+	bool et2 = ET2;
+	uword now, elapsed, period, next;
+	ubyte tooth, i;
+	ulong fraction;
+
+	/* Get a consistent snapshot. */
+	EA = 0;
+	EXM = 0;
+	ET2 = 0;
+	EA = ea;
+	SFR_PAGE(_t2_1, noSST);
+	now = T2CCU_CCTLH;
+	SFR_PAGE(_t2_0, noSST);
+	elapsed = now - crank.lastCapture;
+	period = crank.period;
+	tooth = crank.tooth;
+	/* Detect a stall, the elapsed time wraps with every overflow. */
+	fraction = period >> 1;
+	for (i = crank.missing + 1; i; i--) {
+		fraction += period;
+	}
+	if (crank.synced && ((crank.overflows && now >= crank.lastCapture)
+	                     || elapsed > fraction)) {
+		CRANK_STALL();
+	}
+	if (!crank.synced) {
+		EA = 0;
+		EXM = exm;
+		ET2 = et2;
+		EA = ea;
+		return CRANK_ANGLE_INVALID;
+	}
+	EA = 0;
+	EXM = exm;
+	ET2 = et2;
+	EA = ea;
+
+	/* Interpolate, but do not pass the next tooth edge. */
+	next = (tooth == crank.teeth - crank.missing - 1 ?
+	        crank.missing + 1 : 1) << 8;
+	MDU_DIV32(fraction, (ulong)elapsed << 8, period);
+	if (fraction >= next) {
+		fraction = next - 1;
+	}
+	return ((uword)tooth << 8) + fraction;
+}
+
+void hsk_crank_schedule(const uword __xdata angle,
+                        const void (code * const __xdata callback)
+                                   (void) using(1)) {
+	bool ea = EA;
+	bool exm = EXM;
+
+	EA = 0;
+	EXM = 0;
+	EA = ea;
+	crank.target = angle;
+	crank.callback = callback;
+	EA = 0;
+	EXM = exm;
+	EA = ea;
+}
+
+void hsk_crank_cancel(void) {
+	bool ea = EA;
+	bool exm = EXM;
+
+	EA = 0;
+	EXM = 0;
+	EA = ea;
+	crank.callback = 0;
+	hsk_pwc_channel_close(crank.compare);
+	EA = 0;
+	EXM = exm;
+	EA = ea;
+}
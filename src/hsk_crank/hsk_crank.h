@@ -0,0 +1,154 @@
+/** \file
+ * HSK Crank Angle Tracking headers
+ *
+ * This library tracks the angle of a trigger wheel with a gap, such as
+ * the common 60-2 crank wheels, and schedules events at a given angle.
+ *
+ * The tooth edges are captured by a T2CCU channel, the gap is detected by
+ * comparing the period of each tooth with the period of the previous
+ * tooth. Between teeth the angle is interpolated from the last tooth
+ * period.
+ *
+ * Scheduled events are triggered by a second T2CCU channel in compare
+ * mode, so they are independent of software polling.
+ *
+ * The library is built on top of the PWC library, hsk_pwc_init() must be
+ * called to set up the Capture/Compare Timer before hsk_crank_open().
+ * The window time must be longer than the gap at the lowest speed that
+ * should be tracked. Neither of the two used channels may be opened by
+ * the PWC library.
+ *
+ * A stalled trigger wheel is detected when no tooth edge arrives within
+ * the period of the gap plus half a tooth. This is checked by
+ * hsk_crank_getAngle() and by the CCT overflow interrupt, which ends
+ * synchronization after two window times without a tooth edge, even if
+ * the angle is not polled. Synchronization is regained at the next gap.
+ *
+ * @author kami
+ *
+ * \section crank_angle Angles
+ *
+ * Angles are represented in units of 1/256 tooth, i.e. the full revolution
+ * of a 60 tooth wheel is 15360, one unit represents ~0.0234°. Angle 0 is
+ * the first tooth edge after the gap.
+ */
+
+#ifndef _HSK_CRANK_H_
+#define _HSK_CRANK_H_
+
+/*
+ * Required for SDCC to propagate ISR prototypes.
+ */
+#ifdef SDCC
+#include "../hsk_isr/hsk_isr.isr"
+#endif /* SDCC */
+
+/*
+ * The PWC types are used for the channel selection.
+ */
+#include "../hsk_pwc/hsk_pwc.h"
+
+/*
+ * C51 does not include the used register bank in pointer types.
+ */
+#ifdef __C51__
+	#define using(bank)
+#endif
+
+/*
+ * SDCC does not like the \c code keyword for function pointers, C51 needs it
+ * or it will use generic pointers.
+ */
+#ifdef SDCC
+	#undef code
+	#define code
+#endif /* SDCC */
+
+/**
+ * Returned by hsk_crank_getAngle() while the trigger wheel is not
+ * synchronized.
+ */
+#define CRANK_ANGLE_INVALID    0xffff
+
+/**
+ * Sets up angle tracking.
+ *
+ * The trigger wheel is expected to have the given number of tooth
+ * positions, the last missing positions are the gap. E.g. a 60-2 wheel
+ * has 60 tooth positions of which 2 are missing. Up to 3 missing teeth
+ * are supported.
+ *
+ * Synchronization is achieved at the first gap. It is lost if the gap is
+ * not encountered at the expected tooth or the wheel stalls.
+ *
+ * @param port
+ *	The PWC input port to capture tooth edges on, one of PWC_CCn_Pxy
+ * @param edgeMode
+ *	The tooth edge to capture, \ref PWC_EDGE_FALLING or
+ *	\ref PWC_EDGE_RISING
+ * @param teeth
+ *	The number of tooth positions on the wheel, including missing teeth
+ * @param missing
+ *	The number of missing teeth, 1 to 3
+ * @param compare
+ *	The PWC channel to use for scheduled events, one of PWC_CCn, must
+ *	not be the channel the port belongs to
+ */
+void hsk_crank_open(const hsk_pwc_port port, const ubyte edgeMode,
+                    const ubyte teeth, const ubyte missing,
+                    const hsk_pwc_channel compare);
+
+/**
+ * Returns the current angle of the trigger wheel.
+ *
+ * The angle is interpolated using the period of the last tooth. The
+ * interpolation does not pass the next expected tooth.
+ *
+ * Synchronization is lost if the wheel has stalled.
+ *
+ * @return
+ *	The current angle in 1/256 teeth, or \ref CRANK_ANGLE_INVALID
+ */
+uword hsk_crank_getAngle(void);
+
+/**
+ * Schedules a recurring event at the given angle.
+ *
+ * The event is armed with the tooth edge preceding the angle and
+ * triggered by a compare match. The callback function is called from
+ * the compare interrupt once per revolution, until hsk_crank_cancel()
+ * is called. Only one event can be scheduled at a time.
+ *
+ * If the angle has already been passed in the current tooth, the
+ * first event occurs in the next revolution.
+ *
+ * @param angle
+ *	The angle to trigger the event at, in 1/256 teeth
+ * @param callback
+ *	The function to call back, when the angle is reached
+ */
+void hsk_crank_schedule(const uword __xdata angle,
+                        const void (code * const __xdata callback)
+                                   (void) using(1));
+
+/**
+ * Cancels the scheduled event.
+ */
+void hsk_crank_cancel(void);
+
+/*
+ * Restore the usual meaning of \c code.
+ */
+#ifdef SDCC
+	#undef code
+	#define code	__code
+#endif /* SDCC */
+
+/*
+ * Restore the usual meaning of \c using(bank).
+ */
+#ifdef __C51__
+	#undef using
+#endif /* __C51__ */
+
+#endif /* _HSK_CRANK_H_ */
@@ -0,0 +1,66 @@
+/** \file
+ * HSK CRC-16 headers
+ *
+ * This file contains macros and function prototypes to compute the
+ * CRC-16/CCITT-FALSE of a data block, i.e. polynomial
+ * \f$ x^{16} + x^{12} + x^5 + 1 \f$ (0x1021), initial value 0xffff,
+ * most significant bit first, no final XOR. The CRC of the ASCII string
+ * "123456789" is 0x29b1.
+ *
+ * The CRC is computed byte wise with a 256 entry table in code memory,
+ * which takes 512 bytes of flash.
+ *
+ * If the CRC is appended to a data block in big endian order, the CRC
+ * of the entire block is 0. This allows validating a block without
+ * knowing where the data ends and the CRC starts.
+ *
+ * The CRC can be computed incrementally, e.g. while data arrives over
+ * CAN or is written to the flash. The CRC16_UPDATE() macro does not call
+ * any functions, so it can be used in interrupts with any register bank.
+ *
+ * @author kami
+ */
+
+#ifndef _HSK_CRC_H_
+#define _HSK_CRC_H_
+
+/**
+ * The initial value of a CRC.
+ */
+#define CRC16_INIT           0xffff
+
+/**
+ * The 256 entry CRC-16 table.
+ *
+ * Contains the CRC of every byte value with an initial value of 0.
+ *
+ * @private
+ */
+extern const uword code hsk_crc_table[256];
+
+/**
+ * Adds a byte to a CRC.
+ *
+ * @param crc
+ *	The uword lvalue holding the CRC
+ * @param byte
+ *	The byte to add
+ */
+#define CRC16_UPDATE(crc, byte) \
+	((crc) = ((crc) << 8) ^ hsk_crc_table[(ubyte)((crc) >> 8) ^ (ubyte)(byte)])
+
+/**
+ * Adds a block of data to a CRC.
+ *
+ * @param crc
+ *	The CRC of the preceding data, \ref CRC16_INIT to start a new CRC
+ * @param ptr
+ *	A pointer to the data
+ * @param size
+ *	The number of bytes to add
+ * @return
+ *	The CRC including the given data
+ */
+uword hsk_crc_block(uword crc, const ubyte * const ptr, const uword size);
+
+#endif /* _HSK_CRC_H_ */
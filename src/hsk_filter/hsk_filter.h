@@ -6,6 +6,15 @@
  *
  * The buffer for the filter is stored in xdata memory.
  *
+ * The IIR filters calculate an exponential moving average instead,
+ * which does not require a buffer.
+ *
+ * The median filters suppress spikes, by returning the median of the
+ * buffered values instead of the average.
+ *
+ * The decimation filters reduce the sample rate of an input, they only
+ * produce an output value every given number of samples.
+ *
  * @author kami
  */
 
@@ -153,6 +162,661 @@
 		return prefix[filter].sum / size; \
 	} \
 
+/**
+ * Generates a group of filters that are updated together.
+ *
+ * This works like FILTER_GROUP_FACTORY(), but all filters are updated
+ * in a single call, e.g. with the latest conversion results of all
+ * ADC channels. Because all filters advance in lockstep, they share
+ * a single buffer index and the data is stored as a structure of
+ * arrays. The buffers of all filters for one point in time and all
+ * sums are stored contiguously, so the update can walk through them
+ * with pointers.
+ *
+ * The filters can be accessed with:
+ * - void \<prefix\>_init(void)
+ *	- Initializes all filters with 0
+ * - void \<prefix\>_update(const \<valueType\> * const values)
+ *	- Update all filters, takes an array with one value per filter
+ * - \<valueType\> \<prefix\>_get(const ubyte filter)
+ *	- Return the current average of the given filter
+ *
+ * @param prefix
+ *	A prefix for the generated internals and functions
+ * @param filters
+ *	The number of filters
+ * @param valueType
+ *	The data type of the stored values
+ * @param sumType
+ *	A data type that can contain the sum of all buffered values
+ * @param sizeType
+ *	A data type that can hold the length of the buffer
+ * @param size
+ *	The length of the buffer
+ */
+#define FILTER_VECTOR_FACTORY(prefix, filters, valueType, sumType, sizeType, size) \
+	\
+	/**
+	 * Holds the buffers and their current state.
+	 */ \
+	struct { \
+		/**
+		 * The value buffers, one row of values for all filters
+		 * per update.
+		 */ \
+		valueType values[size][filters]; \
+	\
+		/**
+		 * The sums of the buffered values of each filter.
+		 */ \
+		sumType sums[filters]; \
+	\
+		/**
+		 * The index of the oldest row of buffered values.
+		 */ \
+		sizeType current; \
+	} xdata prefix; \
+	\
+	/**
+	 * Initializes all buffers with 0.
+	 */ \
+	void prefix##_init(void) { \
+		memset(&prefix, 0, sizeof(prefix)); \
+	} \
+	\
+	/**
+	 * Updates all filters.
+	 *
+	 * @param values
+	 *	An array with a new value for each filter
+	 */ \
+	void prefix##_update(const valueType * const values) { \
+		valueType xdata * value = prefix.values[prefix.current]; \
+		sumType xdata * sum = prefix.sums; \
+		ubyte i; \
+		for (i = 0; i < (filters); i++) { \
+			*sum -= *value; \
+			*value = values[i]; \
+			*sum++ += *value++; \
+		} \
+		if (++prefix.current >= (size)) { \
+			prefix.current = 0; \
+		} \
+	} \
+	\
+	/**
+	 * Returns the current sliding average of the buffered values of
+	 * a filter.
+	 *
+	 * @param filter
+	 *	The filter to return the average of
+	 * @return
+	 *	The average of the buffered values
+	 */ \
+	valueType prefix##_get(const ubyte filter) { \
+		return prefix.sums[filter] / (size); \
+	} \
+
+
+/**
+ * Generates a filter with a power of 2 buffer length.
+ *
+ * This works like FILTER_FACTORY(), but the division and modulo
+ * operations are guaranteed to be performed with shift and mask
+ * operations, regardless of what the compiler makes of them.
+ *
+ * For signed types the average is rounded towards negative infinity
+ * instead of 0.
+ *
+ * The filter can be accessed with:
+ * - void \<prefix\>_init(void)
+ *	- Initializes the filter with 0
+ * - \<valueType\> \<prefix\>_update(const \<valueType\> value)
+ *	- Update the filter and return the current average
+ *
+ * @param prefix
+ *	A prefix for the generated internals and functions
+ * @param valueType
+ *	The data type of the stored values
+ * @param sumType
+ *	A data type that can contain the sum of all buffered values
+ * @param sizeType
+ *	A data type that can hold the length of the buffer
+ * @param shift
+ *	The length of the buffer is 2^shift
+ */
+#define FILTER_POW2_FACTORY(prefix, valueType, sumType, sizeType, shift) \
+	\
+	/**
+	 * Holds the buffer and its current state.
+	 */ \
+	struct { \
+		/**
+		 * The value buffer.
+		 */ \
+		valueType values[1 << (shift)]; \
+	\
+		/**
+		 * The sum of the buffered values.
+		 */ \
+		sumType sum; \
+	\
+		/**
+		 * The index of the oldest buffered value.
+		 */ \
+		sizeType current; \
+	} xdata prefix; \
+	\
+	/**
+	 * Initializes the buffer with 0.
+	 */ \
+	void prefix##_init(void) { \
+		memset(&prefix, 0, sizeof(prefix)); \
+	} \
+	\
+	/**
+	 * Updates the filter and returns the current sliding average of
+	 * buffered values.
+	 *
+	 * @param value
+	 *	The value to add to the buffer
+	 * @return
+	 *	The average of the buffed values
+	 */ \
+	valueType prefix##_update(const valueType value) { \
+		prefix.sum -= prefix.values[prefix.current]; \
+		prefix.values[prefix.current] = value; \
+		prefix.sum += value; \
+		prefix.current = (prefix.current + 1) & ((1 << (shift)) - 1); \
+		return prefix.sum >> (shift); \
+	} \
+
+
+/**
+ * Generates a group of filters with a power of 2 buffer length.
+ *
+ * This works like FILTER_GROUP_FACTORY(), but the division and modulo
+ * operations are guaranteed to be performed with shift and mask
+ * operations, regardless of what the compiler makes of them.
+ *
+ * For signed types the average is rounded towards negative infinity
+ * instead of 0.
+ *
+ * The filters can be accessed with:
+ * - void \<prefix\>_init(void)
+ *	- Initializes all filters with 0
+ * - \<valueType\> \<prefix\>_update(const ubyte filter, const \<valueType\> value)
+ *	- Update the given filter and return the current average
+ *
+ * @param prefix
+ *	A prefix for the generated internals and functions
+ * @param filters
+ *	The number of filters
+ * @param valueType
+ *	The data type of the stored values
+ * @param sumType
+ *	A data type that can contain the sum of all buffered values
+ * @param sizeType
+ *	A data type that can hold the length of the buffer
+ * @param shift
+ *	The length of the buffer is 2^shift
+ */
+#define FILTER_GROUP_POW2_FACTORY(prefix, filters, valueType, sumType, sizeType, shift) \
+	\
+	/**
+	 * Holds the buffers and their current states.
+	 */ \
+	struct { \
+		/**
+		 * The value buffer.
+		 */ \
+		valueType values[1 << (shift)]; \
+	\
+		/**
+		 * The sum of the buffered values.
+		 */ \
+		sumType sum; \
+	\
+		/**
+		 * The index of the oldest buffered value.
+		 */ \
+		sizeType current; \
+	} xdata prefix[filters]; \
+	\
+	/**
+	 * Initializes all buffers with 0.
+	 */ \
+	void prefix##_init(void) { \
+		memset(&prefix, 0, sizeof(prefix)); \
+	} \
+	\
+	/**
+	 * Updates the given filter and returns the current sliding average of
+	 * buffered values.
+	 *
+	 * @param filter
+	 *	The filter to update
+	 * @param value
+	 *	The value to add to the buffer
+	 * @return
+	 *	The average of the buffed values
+	 */ \
+	valueType prefix##_update(const ubyte filter, const valueType value) { \
+		prefix[filter].sum -= prefix[filter].values[prefix[filter].current]; \
+		prefix[filter].values[prefix[filter].current] = value; \
+		prefix[filter].sum += value; \
+		prefix[filter].current = (prefix[filter].current + 1) & ((1 << (shift)) - 1); \
+		return prefix[filter].sum >> (shift); \
+	} \
+
+/**
+ * Generates a first order IIR filter, i.e. an exponential moving average.
+ *
+ * Every update moves the average by \f$ \alpha = 2^{-shift} \f$ of
+ * the distance to the new value. This has a similar smoothing effect as
+ * a sliding average over \f$ 2^{shift + 1} \f$ values, but only the
+ * accumulator has to be stored.
+ *
+ * The accumulator holds the average with shift fraction bits, so no
+ * precision is lost over repeated updates.
+ *
+ * The filter can be accessed with:
+ * - void \<prefix\>_init(void)
+ *	- Initializes the filter with 0
+ * - \<valueType\> \<prefix\>_update(const \<valueType\> value)
+ *	- Update the filter and return the current average
+ *
+ * @param prefix
+ *	A prefix for the generated internals and functions
+ * @param valueType
+ *	The data type of the filtered values
+ * @param sumType
+ *	A data type that can contain a value multiplied with 2^shift
+ * @param shift
+ *	The smoothing factor
+ */
+#define IIR_FILTER_FACTORY(prefix, valueType, sumType, shift) \
+	\
+	/**
+	 * Holds the accumulator.
+	 */ \
+	struct { \
+		/**
+		 * The average with shift fraction bits.
+		 */ \
+		sumType sum; \
+	} xdata prefix; \
+	\
+	/**
+	 * Initializes the accumulator with 0.
+	 */ \
+	void prefix##_init(void) { \
+		prefix.sum = 0; \
+	} \
+	\
+	/**
+	 * Updates the filter and returns the current average.
+	 *
+	 * @param value
+	 *	The value to add to the average
+	 * @return
+	 *	The exponential moving average
+	 */ \
+	valueType prefix##_update(const valueType value) { \
+		prefix.sum += value - (prefix.sum >> (shift)); \
+		return prefix.sum >> (shift); \
+	} \
+
+
+/**
+ * Generates a second order IIR filter, i.e. two cascaded exponential
+ * moving averages.
+ *
+ * This works like IIR_FILTER_FACTORY(), but the output of the first
+ * stage is smoothed again by a second stage with the same smoothing
+ * factor. This attenuates high frequencies more strongly, at the cost
+ * of a slower response.
+ *
+ * The filter can be accessed with:
+ * - void \<prefix\>_init(void)
+ *	- Initializes the filter with 0
+ * - \<valueType\> \<prefix\>_update(const \<valueType\> value)
+ *	- Update the filter and return the current average
+ *
+ * @param prefix
+ *	A prefix for the generated internals and functions
+ * @param valueType
+ *	The data type of the filtered values
+ * @param sumType
+ *	A data type that can contain a value multiplied with 2^shift
+ * @param shift
+ *	The smoothing factor of each stage
+ */
+#define IIR2_FILTER_FACTORY(prefix, valueType, sumType, shift) \
+	\
+	/**
+	 * Holds the accumulators.
+	 */ \
+	struct { \
+		/**
+		 * The first stage average with shift fraction bits.
+		 */ \
+		sumType sum1; \
+	\
+		/**
+		 * The second stage average with shift fraction bits.
+		 */ \
+		sumType sum2; \
+	} xdata prefix; \
+	\
+	/**
+	 * Initializes the accumulators with 0.
+	 */ \
+	void prefix##_init(void) { \
+		prefix.sum1 = 0; \
+		prefix.sum2 = 0; \
+	} \
+	\
+	/**
+	 * Updates the filter and returns the current average.
+	 *
+	 * @param value
+	 *	The value to add to the average
+	 * @return
+	 *	The second order exponential moving average
+	 */ \
+	valueType prefix##_update(const valueType value) { \
+		prefix.sum1 += value - (prefix.sum1 >> (shift)); \
+		prefix.sum2 += (valueType)(prefix.sum1 >> (shift)) \
+		               - (prefix.sum2 >> (shift)); \
+		return prefix.sum2 >> (shift); \
+	} \
+
+/**
+ * Generates a running median filter.
+ *
+ * In addition to the value buffer a sorted copy of the buffer is
+ * maintained. Every update removes the oldest value from the sorted
+ * buffer and inserts the new value, by moving the values in between,
+ * which takes at most size steps. The median is read from the middle
+ * of the sorted buffer.
+ *
+ * Odd buffer lengths should be preferred, for even lengths the upper of
+ * the two middle values is returned.
+ *
+ * The filter can be accessed with:
+ * - void \<prefix\>_init(void)
+ *	- Initializes the filter with 0
+ * - \<valueType\> \<prefix\>_update(const \<valueType\> value)
+ *	- Update the filter and return the current median
+ *
+ * @param prefix
+ *	A prefix for the generated internals and functions
+ * @param valueType
+ *	The data type of the stored values
+ * @param sizeType
+ *	A data type that can hold the length of the buffer
+ * @param size
+ *	The length of the buffer
+ */
+#define MEDIAN_FILTER_FACTORY(prefix, valueType, sizeType, size) \
+	\
+	/**
+	 * Holds the buffers and their current state.
+	 */ \
+	struct { \
+		/**
+		 * The value buffer.
+		 */ \
+		valueType values[size]; \
+	\
+		/**
+		 * The buffered values in ascending order.
+		 */ \
+		valueType sorted[size]; \
+	\
+		/**
+		 * The index of the oldest buffered value.
+		 */ \
+		sizeType current; \
+	} xdata prefix; \
+	\
+	/**
+	 * Initializes the buffers with 0.
+	 */ \
+	void prefix##_init(void) { \
+		memset(&prefix, 0, sizeof(prefix)); \
+	} \
+	\
+	/**
+	 * Updates the filter and returns the current median of buffered
+	 * values.
+	 *
+	 * @param value
+	 *	The value to add to the buffer
+	 * @return
+	 *	The median of the buffered values
+	 */ \
+	valueType prefix##_update(const valueType value) { \
+		sizeType i; \
+		/* Find the oldest value in the sorted buffer. */ \
+		for (i = 0; prefix.sorted[i] != prefix.values[prefix.current]; i++); \
+		/* Move greater values down until the new value fits in. */ \
+		for (; i < (size) - 1 && prefix.sorted[i + 1] < value; i++) { \
+			prefix.sorted[i] = prefix.sorted[i + 1]; \
+		} \
+		/* Move lesser values up until the new value fits in. */ \
+		for (; i && prefix.sorted[i - 1] > value; i--) { \
+			prefix.sorted[i] = prefix.sorted[i - 1]; \
+		} \
+		prefix.sorted[i] = value; \
+		/* Replace the oldest value. */ \
+		prefix.values[prefix.current++] = value; \
+		prefix.current %= size; \
+		return prefix.sorted[(size) / 2]; \
+	} \
+
+/**
+ * Generates a decimating boxcar filter.
+ *
+ * The filter sums up the given number of values and produces the
+ * average of the sum as an output value, i.e. the output rate is the
+ * input rate divided by ratio. Per input value only an addition is
+ * performed, the division is performed once per output value.
+ *
+ * The filter can be accessed with:
+ * - void \<prefix\>_init(void)
+ *	- Initializes the filter with 0
+ * - bool \<prefix\>_update(const \<valueType\> value)
+ *	- Add a value, returns 1 if a new output value is available
+ * - \<valueType\> \<prefix\>_get(void)
+ *	- Return the last output value
+ *
+ * @param prefix
+ *	A prefix for the generated internals and functions
+ * @param valueType
+ *	The data type of the filtered values
+ * @param sumType
+ *	A data type that can contain the sum of ratio values
+ * @param sizeType
+ *	A data type that can hold the ratio
+ * @param ratio
+ *	The number of input values per output value
+ */
+#define DECIMATION_FILTER_FACTORY(prefix, valueType, sumType, sizeType, ratio) \
+	\
+	/**
+	 * Holds the accumulator and its current state.
+	 */ \
+	struct { \
+		/**
+		 * The sum of the values since the last output.
+		 */ \
+		sumType sum; \
+	\
+		/**
+		 * The last output value.
+		 */ \
+		valueType output; \
+	\
+		/**
+		 * The number of values since the last output.
+		 */ \
+		sizeType count; \
+	} xdata prefix; \
+	\
+	/**
+	 * Initializes the filter with 0.
+	 */ \
+	void prefix##_init(void) { \
+		memset(&prefix, 0, sizeof(prefix)); \
+	} \
+	\
+	/**
+	 * Adds a value to the filter.
+	 *
+	 * @param value
+	 *	The value to add
+	 * @retval 1
+	 *	A new output value is available
+	 * @retval 0
+	 *	No new output value is available
+	 */ \
+	bool prefix##_update(const valueType value) { \
+		prefix.sum += value; \
+		if (++prefix.count < (ratio)) { \
+			return 0; \
+		} \
+		prefix.output = prefix.sum / (ratio); \
+		prefix.sum = 0; \
+		prefix.count = 0; \
+		return 1; \
+	} \
+	\
+	/**
+	 * Returns the last output value.
+	 *
+	 * @return
+	 *	The average of the values of the last completed decimation
+	 *	period
+	 */ \
+	valueType prefix##_get(void) { \
+		return prefix.output; \
+	} \
+
+
+/**
+ * Generates a decimating cascaded integrator-comb (CIC) filter.
+ *
+ * The CIC filter is equivalent to a chain of stages boxcar filters,
+ * which gives it better anti-aliasing properties than a single
+ * boxcar filter. Per input value the filter performs one addition per
+ * stage. Per output value it performs one subtraction per stage and a
+ * shift to compensate the gain of \f$ 2^{stages \cdot shift} \f$.
+ *
+ * The integrators rely on the wrap around of unsigned integer
+ * overflows, so the sumType should be unsigned and must be able to
+ * hold \f$ max(valueType) \cdot 2^{stages \cdot shift} \f$.
+ *
+ * The filter can be accessed with:
+ * - void \<prefix\>_init(void)
+ *	- Initializes the filter with 0
+ * - bool \<prefix\>_update(const \<valueType\> value)
+ *	- Add a value, returns 1 if a new output value is available
+ * - \<valueType\> \<prefix\>_get(void)
+ *	- Return the last output value
+ *
+ * @param prefix
+ *	A prefix for the generated internals and functions
+ * @param valueType
+ *	The data type of the filtered values
+ * @param sumType
+ *	The unsigned data type of the integrators and combs
+ * @param sizeType
+ *	A data type that can hold the decimation ratio
+ * @param stages
+ *	The number of integrator and comb stages
+ * @param shift
+ *	The decimation ratio is 2^shift
+ */
+#define CIC_FILTER_FACTORY(prefix, valueType, sumType, sizeType, stages, shift) \
+	\
+	/**
+	 * Holds the filter stages and the current state.
+	 */ \
+	struct { \
+		/**
+		 * The integrator stages.
+		 */ \
+		sumType integrators[stages]; \
+	\
+		/**
+		 * The comb stage delay elements.
+		 */ \
+		sumType combs[stages]; \
+	\
+		/**
+		 * The last output value.
+		 */ \
+		valueType output; \
+	\
+		/**
+		 * The number of values since the last output.
+		 */ \
+		sizeType count; \
+	} xdata prefix; \
+	\
+	/**
+	 * Initializes the filter with 0.
+	 */ \
+	void prefix##_init(void) { \
+		memset(&prefix, 0, sizeof(prefix)); \
+	} \
+	\
+	/**
+	 * Adds a value to the filter.
+	 *
+	 * @param value
+	 *	The value to add
+	 * @retval 1
+	 *	A new output value is available
+	 * @retval 0
+	 *	No new output value is available
+	 */ \
+	bool prefix##_update(const valueType value) { \
+		sumType comb, delayed; \
+		ubyte i; \
+		/* Integrate. */ \
+		prefix.integrators[0] += value; \
+		for (i = 1; i < (stages); i++) { \
+			prefix.integrators[i] += prefix.integrators[i - 1]; \
+		} \
+		if (++prefix.count < (1 << (shift))) { \
+			return 0; \
+		} \
+		prefix.count = 0; \
+		/* Decimate and differentiate. */ \
+		comb = prefix.integrators[(stages) - 1]; \
+		for (i = 0; i < (stages); i++) { \
+			delayed = prefix.combs[i]; \
+			prefix.combs[i] = comb; \
+			comb -= delayed; \
+		} \
+		/* Compensate the gain. */ \
+		prefix.output = comb >> ((stages) * (shift)); \
+		return 1; \
+	} \
+	\
+	/**
+	 * Returns the last output value.
+	 *
+	 * @return
+	 *	The last filtered and decimated value
+	 */ \
+	valueType prefix##_get(void) { \
+		return prefix.output; \
+	} \
+
 
 #endif /* _HSK_FILTER_H_ */
 
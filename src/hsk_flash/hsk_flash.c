@@ -32,6 +32,7 @@
 #include <string.h> /* memset() */
 
 #include "../hsk_isr/hsk_isr.h"
+#include "../hsk_crc/hsk_crc.h"
 
 /*
  * Compiler tweaks.
@@ -100,6 +101,13 @@
 #error Assembly code for the current compiler missing
 #endif
 
+/*
+ * C51 does not include the used register bank in pointer types.
+ */
+#ifdef __C51__
+	#define using(bank)
+#endif
+
 /*
  * XC878-16FF code/flash layout.
  */
@@ -399,6 +407,16 @@ SFR(FCS1,    0xDD);
  */
 #define STATE_RESET                 60
 
+/**
+ * Evaluates to 1 if the given state belongs to a write.
+ *
+ * @param state
+ *	The state machine state
+ */
+#define WRITING(state) \
+	((state) != STATE_IDLE && (state) < STATE_DETECT \
+	 || (state) >= STATE_WRITE && (state) < STATE_DELETE)
+
 /**
  * The block indicated \ref hsk_flash.latest is available for writing.
  */
@@ -415,6 +433,142 @@ SFR(FCS1,    0xDD);
  */
 #define FREE_NONE                   2
 
+#ifdef FLASH_CRC
+/**
+ * The checksum type, a CRC-16.
+ */
+typedef uword hsk_flash_chksum;
+
+/**
+ * The initial checksum value.
+ */
+#define CHKSUM_INIT                 CRC16_INIT
+
+/**
+ * Adds a byte to a checksum.
+ *
+ * @param sum
+ *	The checksum lvalue
+ * @param byte
+ *	The byte to add
+ */
+#define CHKSUM_ADD(sum, byte)       CRC16_UPDATE(sum, byte)
+#else /* FLASH_CRC */
+/**
+ * The checksum type, the simple checksum used in the Intel HEX (.ihx)
+ * file format.
+ */
+typedef ubyte hsk_flash_chksum;
+
+/**
+ * The initial checksum value.
+ */
+#define CHKSUM_INIT                 0
+
+/**
+ * Adds a byte to a checksum.
+ *
+ * @param sum
+ *	The checksum lvalue
+ * @param byte
+ *	The byte to add
+ */
+#define CHKSUM_ADD(sum, byte)       ((sum) += (byte))
+#endif /* FLASH_CRC */
+
+/**
+ * Flips the alternating bits of \ref hsk_flash.ident to identify patch
+ * areas.
+ */
+#define PATCH_MARK                  0xc0
+
+/**
+ * The size of the patch envelope, i.e. marker, offset, length and
+ * checksum.
+ */
+#define PATCH_ENVELOPE              (4 + FLASH_CHKSUM_SIZE)
+
+/**
+ * The maximum number of data bytes in a patch.
+ *
+ * Larger changes are written as a full image.
+ */
+#define PATCH_DATA                  16
+
+/**
+ * The D-Flash holds a single struct, see hsk_flash_init().
+ */
+#define MODE_STRUCT                 0
+
+/**
+ * The D-Flash holds a log of records, see hsk_flash_record_init().
+ */
+#define MODE_RECORDS                1
+
+/**
+ * The state machine programs the P-Flash, see hsk_flash_pflash_init().
+ */
+#define MODE_PFLASH                 2
+
+/**
+ * Sets bits in the control register of the flash that is being written.
+ *
+ * That is FCON in \ref MODE_PFLASH and EECON otherwise.
+ *
+ * @param bits
+ *	The bits to set
+ */
+#define CON_SET(bits) \
+	if (flash.mode == MODE_PFLASH) { FCON |= (bits); } else { EECON |= (bits); }
+
+/**
+ * Clears bits in the control register of the flash that is being written.
+ *
+ * That is FCON in \ref MODE_PFLASH and EECON otherwise.
+ *
+ * @param bits
+ *	The bits to clear
+ */
+#define CON_CLEAR(bits) \
+	if (flash.mode == MODE_PFLASH) { FCON &= ~(bits); } else { EECON &= ~(bits); }
+
+#ifndef FLASH_RECORDS
+/**
+ * The maximum number of records that can be opened.
+ *
+ * Every record takes 7 bytes of xdata memory.
+ */
+#define FLASH_RECORDS               8
+#endif
+
+/**
+ * The size of the record envelope, i.e. ID, size and checksum.
+ */
+#define RECORD_ENVELOPE             (2 + FLASH_CHKSUM_SIZE)
+
+/**
+ * The position of records that have no copy in the D-Flash.
+ */
+#define RECORD_NONE                 0xffff
+
+/**
+ * The amount of free D-Flash below which the oldest page is compacted
+ * and deleted.
+ *
+ * Moving the records out of the oldest page takes up to 2 pages, the
+ * remainder is kept free to simplify the space checks.
+ */
+#define RECORD_RESERVE              (4 * BYTES_PAGE_DFLASH)
+
+/*
+ * SDCC does not like the code keyword for function pointers, C51 needs it
+ * or it will use generic pointers.
+ */
+#ifdef SDCC
+	#undef code
+	#define code
+#endif /* SDCC */
+
 /** \var flash
  * Holds the persistence configuration.
  */
@@ -444,6 +598,20 @@ static volatile struct {
 	 */
 	uword latest;
 
+	/**
+	 * The offset of the latest full image in the D-Flash.
+	 *
+	 * If it differs from \ref hsk_flash.latest, the latest block is a
+	 * patch area, that holds patches to the full image in the block
+	 * before.
+	 */
+	uword base;
+
+	/**
+	 * The offset of the next patch within the patch area.
+	 */
+	uword patch;
+
 	/**
 	 * This byte indicates where free space can be found in the D-Flash.
 	 *
@@ -469,8 +637,89 @@ static volatile struct {
 	 * The current state of the flash ISR state machine.
 	 */
 	ubyte state;
+
+	/**
+	 * The D-Flash usage, either \ref MODE_STRUCT or \ref MODE_RECORDS.
+	 */
+	ubyte mode;
+
+	/**
+	 * The number of queued writes.
+	 *
+	 * In \ref MODE_STRUCT a queued write always writes the full image
+	 * and there is never more than one.
+	 */
+	ubyte pending;
+
+	/**
+	 * The checksum of the bytes written so far.
+	 */
+	hsk_flash_chksum chksum;
+
+	/**
+	 * The function to call back when all queued writes are complete.
+	 */
+	void (code *callback)(void) using(2);
 } pdata flash;
 
+/*
+ * Restore the usual meaning of \c code.
+ */
+#ifdef SDCC
+	#undef code
+	#define code	__code
+#endif /* SDCC */
+
+/** \var records
+ * Holds the record log configuration.
+ *
+ * In \ref MODE_RECORDS \ref hsk_flash.ptr and \ref hsk_flash.size refer
+ * to the record that is being written and \ref hsk_flash.oldest is the
+ * start of the oldest page in the log.
+ */
+static volatile struct {
+	/**
+	 * The opened records.
+	 */
+	struct {
+		/**
+		 * The pointer to the xdata record.
+		 */
+		ubyte xdata * ptr;
+
+		/**
+		 * The offset of the latest copy in the D-Flash, or
+		 * \ref RECORD_NONE.
+		 */
+		uword pos;
+
+		/**
+		 * The size of the record.
+		 */
+		ubyte size;
+
+		/**
+		 * The record ID.
+		 */
+		ubyte id;
+
+		/**
+		 * Set while the record is waiting to be written.
+		 */
+		ubyte pending;
+	} list[FLASH_RECORDS];
+
+	/**
+	 * The offset in the D-Flash to write the next record to.
+	 */
+	uword head;
+
+	/**
+	 * The number of opened records.
+	 */
+	ubyte count;
+} xdata records;
+
 /**
  * A pointer to the flash target address.
  *
@@ -485,6 +734,86 @@ static volatile ubyte code * xdata flashDptr;
  */
 static volatile ubyte xdata * xdata xdataDptr;
 
+/**
+ * A pointer to the end of the xdata src range.
+ */
+static volatile ubyte xdata * xdata xdataEnd;
+
+/**
+ * The xdata src for patches.
+ */
+static ubyte xdata delta[PATCH_ENVELOPE + PATCH_DATA];
+
+#pragma save
+#ifdef SDCC
+#pragma nooverlay
+#endif
+/**
+ * Decides the next step of the state machine in \ref MODE_RECORDS.
+ *
+ * If the free space is running out, the records in the oldest page are
+ * written again until the page can be deleted. Otherwise the next pending
+ * record is written.
+ *
+ * When writing, \ref flashDptr, \ref xdataDptr and \ref xdataEnd are
+ * set up. When deleting, \ref flashDptr points to
+ * the oldest page.
+ *
+ * @return
+ *	The state to enter, \ref STATE_IDLE, \ref STATE_WRITE or
+ *	\ref STATE_DELETE
+ * @private
+ */
+ubyte hsk_flash_record_detect(void) using 2 {
+	ubyte idata i;
+	uword idata free;
+
+	/* Get the free space ahead of the head. */
+	free = (LEN_DFLASH + flash.oldest - records.head - 1) % LEN_DFLASH + 1;
+
+	if (free < RECORD_RESERVE) {
+		/* Find a record in the oldest page. */
+		for (i = 0; i < records.count; i++) {
+			if (records.list[i].pos / BYTES_PAGE_DFLASH == flash.oldest / BYTES_PAGE_DFLASH) {
+				break;
+			}
+		}
+		/* The page only holds outdated data. */
+		if (i >= records.count) {
+			flashDptr = dflash + flash.oldest;
+			return STATE_DELETE;
+		}
+	} else {
+		/* Find a pending record. */
+		for (i = 0; i < records.count && !records.list[i].pending; i++);
+		if (i >= records.count) {
+			return STATE_IDLE;
+		}
+	}
+
+	/* Records do not cross page boundaries. */
+	flash.ptr = records.list[i].ptr;
+	flash.size = records.list[i].size;
+	if (records.head % BYTES_PAGE_DFLASH + flash.size > BYTES_PAGE_DFLASH) {
+		records.head += BYTES_PAGE_DFLASH - records.head % BYTES_PAGE_DFLASH;
+		records.head %= LEN_DFLASH;
+	}
+	if (records.list[i].pending) {
+		records.list[i].pending = 0;
+		flash.pending--;
+	}
+	records.list[i].pos = records.head;
+
+	/* Update pointers for writing. */
+	flash.chksum = CHKSUM_INIT;
+	xdataDptr = flash.ptr;
+	xdataEnd = flash.ptr + flash.size;
+	flashDptr = dflash + records.head;
+	records.head = (records.head + flash.size) % LEN_DFLASH;
+	return STATE_WRITE;
+}
+#pragma restore
+
 /**
  * Flash delete/write state machine.
  *
@@ -567,11 +896,50 @@ void hsk_flash_isr_nmiflash(void) using 2 {
 	 *   deleted.
 	 *
 	 *   It either goes into \ref STATE_DELETE or \ref STATE_IDLE.
+	 *   It goes into \ref STATE_WRITE to start a queued write, in
+	 *   \ref MODE_RECORDS that includes moving records out of the
+	 *   oldest page.
 	 */
 	case STATE_DETECT:
 		/* Turn off the timer. */
 		FCS &= ~(1 << BIT_FTEN);
 
+		/* Nothing to clean up in the P-Flash. */
+		if (flash.mode == MODE_PFLASH) {
+			flash.state = STATE_IDLE;
+			break;
+		}
+
+		if (flash.mode == MODE_RECORDS) {
+			switch (hsk_flash_record_detect()) {
+			case STATE_WRITE:
+				goto state_write;
+				break;
+			case STATE_DELETE:
+				goto state_delete;
+				break;
+			}
+			flash.state = STATE_IDLE;
+			break;
+		}
+
+		/* Start a queued write once there is space. */
+		if (flash.pending && flash.free != FREE_NONE
+				&& (flash.free != FREE_BEHIND
+				|| (flash.wrap + flash.oldest - flash.latest - flash.size) % flash.wrap >= flash.size)) {
+			flash.pending = 0;
+			if (flash.free == FREE_BEHIND) {
+				flash.latest = (flash.latest + flash.size) % flash.wrap;
+			}
+			flash.base = flash.latest;
+			flash.patch = 0;
+			flash.chksum = CHKSUM_INIT;
+			xdataDptr = flash.ptr;
+			xdataEnd = flash.ptr + flash.size;
+			flashDptr = dflash + flash.latest;
+			goto state_write;
+		}
+
 		switch (flash.free) {
 		case FREE_NONE:
 			flashDptr = dflash + flash.oldest;
@@ -584,8 +952,11 @@ void hsk_flash_isr_nmiflash(void) using 2 {
 			}
 			break;
 		case FREE_BEHIND:
-			if (flash.oldest + BYTES_PAGE_DFLASH <= flash.latest \
-					|| flash.latest + flash.size <= flash.oldest) {
+			/* Keep the latest block and the image it patches. */
+			if ((flash.oldest + BYTES_PAGE_DFLASH <= flash.latest \
+					|| flash.latest + flash.size <= flash.oldest) \
+					&& (flash.oldest + BYTES_PAGE_DFLASH <= flash.base \
+					|| flash.base + flash.size <= flash.oldest)) {
 				flashDptr = dflash + flash.oldest;
 				goto state_delete;
 			}
@@ -599,7 +970,7 @@ void hsk_flash_isr_nmiflash(void) using 2 {
 	 *
 	 *   The next address to write is expected in \ref flashDptr.
 	 *   The next address to read from XRAM is expected in
-	 *   \ref xdataDptr.
+	 *   \ref xdataDptr, the end of the XRAM range in \ref xdataEnd.
 	 */
 	case STATE_WRITE:
 		/* Set program flash timer mode, 5µs for an overflow. */
@@ -610,7 +981,7 @@ void hsk_flash_isr_nmiflash(void) using 2 {
 		/* 1.
 		 * Set the bit FCON.PROG (P-Flash) or EECON.PROG (D-Flash) to
 		 * signal the start of a programming cyle. */
-		EECON |= 1 << BIT_PROG;
+		CON_SET(1 << BIT_PROG);
 
 		/* 2.
 		 * Execute a “MOVC” instruction with a dummy data to any
@@ -657,7 +1028,7 @@ __endasm;
 		/* 4.
 		 * Set the bit FCON/EECON.NVSTR for charge pump to drive high
 		 * voltage. */
-		EECON |= 1 << BIT_NVSTR;
+		CON_SET(1 << BIT_NVSTR);
 
 		/* 5.
 		 * Delay for a minimum of 10 us (Tpgs). */
@@ -674,6 +1045,24 @@ __endasm;
 	state_write_loop:
 		flash.state = STATE_WRITE + 3;
 
+		/* The last bytes take the checksum of the preceding bytes. */
+		if (xdataDptr + FLASH_CHKSUM_SIZE < xdataEnd || flash.mode == MODE_PFLASH) {
+			CHKSUM_ADD(flash.chksum, *xdataDptr);
+#ifdef FLASH_CRC
+		} else if (xdataDptr + 1 < xdataEnd) {
+			/* Append the CRC in big endian order, so the CRC of
+			 * the entire block becomes 0. */
+			*xdataDptr = flash.chksum >> 8;
+		} else {
+			*xdataDptr = flash.chksum;
+		}
+#else
+		} else {
+			/* The checksum of the entire block becomes 0. */
+			*xdataDptr = -flash.chksum;
+		}
+#endif
+
 		/* 6.
 		 * Execute a “MOVC” instruction to the flash address to be
 		 * accessed. FCON/EECON.YE and FCS.FTEN is set by hardware
@@ -743,18 +1132,19 @@ __endasm;
 
 		/* 8.
 		 * Clear the bits FCON/EECON.YE and FCS.FTEN respectively. */
-		EECON &= ~(1 << BIT_YE);
+		CON_CLEAR(1 << BIT_YE);
 
 		/* 9.
 		 * Repeat steps 6 to 8 for any further programming of data to
 		 * the same row. */
-		if (xdataDptr < &flash.ptr[flash.size] && (flashDptr - dflash) % BYTES_WORDLINE_DFLASH != 0) {
+		if (xdataDptr < xdataEnd && (uword)flashDptr % (flash.mode == MODE_PFLASH ?
+				BYTES_WORDLINE_PFLASH : BYTES_WORDLINE_DFLASH) != 0) {
 			goto state_write_loop;
 		}
 
 		/* 10.
 		 * Clear the bit FCON/EECON.PROG. */
-		EECON &= ~(1 << BIT_PROG);
+		CON_CLEAR(1 << BIT_PROG);
 
 		/* 11.
 		 * Delay for a minimum of 5 us (Tnvh) */
@@ -764,11 +1154,11 @@ __endasm;
 	case STATE_WRITE + 8:
 		/* 12.
 		 * Clear the bit FCON/EECON.NVSTR. */
-		EECON &= ~(1 << BIT_NVSTR);
+		CON_CLEAR(1 << BIT_NVSTR);
 		/* 13.
 		 * Delay for a minimum of 1 us (Trcv). */
 		/* Actually just wait for the completion of another 5µs. */
-		if (xdataDptr < &flash.ptr[flash.size]) {
+		if (xdataDptr < xdataEnd) {
 			/* Still something left to write, start with a
 			 * new wordline. */
 			flash.state = STATE_WRITE;
@@ -776,6 +1166,11 @@ __endasm;
 			/* Write completed. */
 			flash.state = STATE_DETECT;
 			flash.free = FREE_BEHIND;
+			/* Report when everything is written. */
+			if (!flash.pending && flash.callback) {
+				RESET_RMAP();
+				flash.callback();
+			}
 		}
 		break;
 	/**
@@ -791,7 +1186,8 @@ __endasm;
 		 * Set the bit FCON/EECON.ERASE and clear the bit
 		 * FCON/EECON.MAS1 to trigger the start of the page erase
 		 * cycle. */
-		EECON = (EECON & ~(1 << BIT_MAS1)) | (1 << BIT_ERASE);
+		CON_CLEAR(1 << BIT_MAS1);
+		CON_SET(1 << BIT_ERASE);
 
 		/* 2.
 		 * Execute a “MOVC” instruction with a dummy data to any
@@ -837,7 +1233,7 @@ __endasm;
 		/* 4.
 		 * Set the bit FCON/EECON.NVSTR for charge pump to drive high
 		 * voltage. */
-		EECON |= 1 << BIT_NVSTR;
+		CON_SET(1 << BIT_NVSTR);
 
 		/* 5.
 		 * Delay for a minimum of 20 ms (Terase). */
@@ -853,7 +1249,7 @@ __endasm;
 
 		/* 6.
 		 * Clear bit FCON/EECON.ERASE. */
-		EECON &= ~(1 << BIT_ERASE);
+		CON_CLEAR(1 << BIT_ERASE);
 
 		/* 7.
 		 * Delay for a minimum of 5 us (Tnvh) */
@@ -863,12 +1259,18 @@ __endasm;
 	case STATE_DELETE + 3:
 		/* 8.
 		 * Clear the bit FCON/EECON.NVSTR. */
-		EECON &= ~(1 << BIT_NVSTR);
+		CON_CLEAR(1 << BIT_NVSTR);
 
 		/* 9.
 		 * Delay for a minimum of 1 us (Trcv). */
 		/* Just wait for the next 5µs tick. */
 
+		/* Program the P-Flash page that was just erased. */
+		if (flash.mode == MODE_PFLASH) {
+			flash.state = STATE_WRITE;
+			break;
+		}
+
 		/* Move the oldest pointer to the start of the next page. */
 		flash.oldest += BYTES_PAGE_DFLASH - (flash.oldest % BYTES_PAGE_DFLASH);
 		if (flash.oldest >= flash.wrap) {
@@ -972,21 +1374,113 @@ __endasm;
 		 * to sleep. */
 		FTVAL = 120 << BIT_OFVAL;
 		flash.state = STATE_IDLE;
+
+		/* Pick up records queued during the mass erase. */
+		if (flash.mode == MODE_RECORDS) {
+			flash.state = STATE_DETECT;
+			FCS |= 1 << BIT_FTEN;
+		}
 		break;
 	}
 }
 #pragma restore
 
+/**
+ * Finds the latest block and the oldest page by looking at the first
+ * byte of every page.
+ *
+ * Pages are only deleted as a whole and blocks are written in sequence,
+ * so every page that holds data starts with data. Because
+ * \ref STATE_DETECT deletes all pages that are not needed, the used
+ * pages form a single run. The end of the run holds the latest block.
+ *
+ * This takes no more than a couple of hundred D-Flash reads, independent
+ * of the size of the struct. If the D-Flash does not look like expected,
+ * e.g. after changing the struct size or after a power loss while pages
+ * were being deleted, the caller has to fall back to scanning the entire
+ * D-Flash.
+ *
+ * @retval 1
+ *	\ref hsk_flash.latest, \ref hsk_flash.oldest and \ref hsk_flash.free
+ *	were set up
+ * @retval 0
+ *	The D-Flash layout was not recognized
+ * @private
+ */
+bool hsk_flash_seek(void) {
+	uword pages;
+	uword page;
+	uword first;
+	uword pos;
+	ubyte runs;
+
+	pages = (flash.wrap + BYTES_PAGE_DFLASH - 1) / BYTES_PAGE_DFLASH;
+
+	/* Find the used pages following an unused page. */
+	runs = 0;
+	first = 0;
+	for (page = 0; page < pages; page++) {
+		if (dflash[page * BYTES_PAGE_DFLASH] != 0xff
+				&& dflash[(page + pages - 1) % pages * BYTES_PAGE_DFLASH] == 0xff) {
+			first = page;
+			runs++;
+		}
+	}
+
+	if (runs > 1) {
+		/* Leftovers, let the scan find them. */
+		return 0;
+	} else if (!runs) {
+		/* The D-Flash is either entirely free or entirely used. */
+		if (dflash[0] != 0xff) {
+			return 0;
+		}
+		flash.oldest = 0;
+		flash.latest = 0;
+		flash.free = FREE_LATEST;
+		pos = 0;
+	} else {
+		/* Find the last page of the run. */
+		for (page = first; dflash[(page + 1) % pages * BYTES_PAGE_DFLASH] != 0xff;
+			page = (page + 1) % pages);
+		/* Walk left, seek the newest data. */
+		pos = page * BYTES_PAGE_DFLASH + BYTES_PAGE_DFLASH - 1;
+		if (pos >= flash.wrap) {
+			pos = flash.wrap - 1;
+		}
+		for (; dflash[pos] == 0xff; pos--);
+		flash.oldest = first * BYTES_PAGE_DFLASH;
+		flash.latest = pos - pos % flash.size;
+		flash.free = FREE_BEHIND;
+		pos = (flash.latest + flash.size) % flash.wrap;
+	}
+
+	/* Make sure the next block is free. */
+	for (page = 0; page < flash.size; page++) {
+		if (dflash[pos + page] != 0xff) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
 ubyte hsk_flash_init(void xdata * const ptr, const uword __xdata size,
 		const ubyte __xdata version) {
 	uword i;
-	ubyte chksum;
+	uword pos;
+	uword end;
+	uword valid;
+	hsk_flash_chksum chksum;
+	ubyte len;
 
 	/* Setup the xdata area to persist. */
 	flash.ptr = ptr;
 	flash.size = size;
 	flash.wrap = (sizeof(dflash) / size) * size;
 	flash.ident = (version & 0x3f) | 0x40;
+	flash.mode = MODE_STRUCT;
+	flash.pending = 0;
+	flash.callback = 0;
 	flashDptr = 0;
 	xdataDptr = 0;
 
@@ -1001,66 +1495,92 @@ ubyte hsk_flash_init(void xdata * const ptr, const uword __xdata size,
 	#define free      flash.free
 	#define state     flash.state
 	#define ident     flash.ident
-	/* Find an unused block. */
-	free = FREE_NONE;
-	for (oldest = 0; oldest < wrap; oldest++) {
-		/* There is data written in this block. */
-		if (dflash[oldest] != 0xff) {
-			/* Jump forward to the next block. */
-			oldest -= oldest % size;
-			oldest += size;
-		}
-		/* End of block reached. */
-		else if (oldest % size == size - 1) {
-			/* Go back to the beginning of the block. */
-			oldest -= oldest % size;
-			free = FREE_BEHIND;
-			break;
+	#define base      flash.base
+	#define patch     flash.patch
+	/* Try to find the latest block and the oldest page quickly, fall
+	 * back to scanning the entire D-Flash. */
+	if (!hsk_flash_seek()) {
+		/* Find an unused block. */
+		free = FREE_NONE;
+		for (oldest = 0; oldest < wrap; oldest++) {
+			/* There is data written in this block. */
+			if (dflash[oldest] != 0xff) {
+				/* Jump forward to the next block. */
+				oldest -= oldest % size;
+				oldest += size;
+			}
+			/* End of block reached. */
+			else if (oldest % size == size - 1) {
+				/* Go back to the beginning of the block. */
+				oldest -= oldest % size;
+				free = FREE_BEHIND;
+				break;
+			}
 		}
-	}
 
-	/* No free blocks at all, mass delete obligatory! */
-	if (oldest >= wrap) {
-		oldest = 0;
-		latest = 0;
-		/* Kick off the ISR, start to delete. */
-		state = STATE_DETECT;
-		NMICON |= 1 << BIT_NMIFLASH;
-		SET_RMAP();
-		FCS |= 1 << BIT_FTEN;
-		RESET_RMAP();
+		/* No free blocks at all, mass delete obligatory! */
+		if (oldest >= wrap) {
+			oldest = 0;
+			latest = 0;
+			base = 0;
+			patch = 0;
+			/* Kick off the ISR, start to delete. */
+			state = STATE_DETECT;
+			NMICON |= 1 << BIT_NMIFLASH;
+			SET_RMAP();
+			FCS |= 1 << BIT_FTEN;
+			RESET_RMAP();
+
+			/* Check whether XRAM data is consistent. */
+			if (ptr[0] == ident) {
+				return 1;
+			}
 
-		/* Check whether XRAM data is consistent. */
-		if (ptr[0] == ident) {
-			return 1;
+			/* Setup data envelope. */
+			memset(ptr, 0, size);
+			ptr[0] = ident;
+			return 0;
 		}
 
-		/* Setup data envelope. */
-		memset(ptr, 0, size);
-		ptr[0] = ident;
-		return 0;
-	}
+		/* Walk left, seek the newest data. */
+		for (latest = (wrap + oldest - 1) % wrap;
+			dflash[latest] == 0xff && latest != oldest;
+			latest = (wrap + latest - 1) % wrap);
+		/* Align to the beginning of the block. */
+		latest -= latest % size;
+		/* No data at all in the flash, i.e. the flash is entirely free.
+		 * Note that up to this point oldest holds the position of a free
+		 * block. */
+		if (latest == oldest) {
+			/* The latest pointer points to a free block. */
+			free = FREE_LATEST;
+		}
 
-	/* Walk left, seek the newest data. */
-	for (latest = (wrap + oldest - 1) % wrap;
-		dflash[latest] == 0xff && latest != oldest;
-		latest = (wrap + latest - 1) % wrap);
-	/* Align to the beginning of the block. */
-	latest -= latest % size;
-	/* No data at all in the flash, i.e. the flash is entirely free.
-	 * Note that up to this point oldest holds the position of a free
-	 * block. */
-	if (latest == oldest) {
-		/* The latest pointer points to a free block. */
-		free = FREE_LATEST;
+		/* Walk right, seek the oldest data. */
+		for (oldest = (oldest + size) % wrap;
+			dflash[oldest] == 0xff && oldest != latest;
+			oldest = (oldest + 1) % wrap);
+		/* Align to the beginning of the page. */
+		oldest = oldest - (oldest % BYTES_PAGE_DFLASH);
 	}
 
-	/* Walk right, seek the oldest data. */
-	for (oldest = (oldest + size) % wrap;
-		dflash[oldest] == 0xff && oldest != latest;
-		oldest = (oldest + 1) % wrap);
-	/* Align to the beginning of the page. */
-	oldest = oldest - (oldest % BYTES_PAGE_DFLASH);
+	/* A patch area applies to the image in the block before. */
+	base = latest;
+	end = 0;
+	if (dflash[latest] == (ident ^ PATCH_MARK)) {
+		base = (wrap + latest - size) % wrap;
+		/* Seek the end of the patch area. */
+		while (end + PATCH_ENVELOPE <= size
+				&& dflash[latest + end] == (ident ^ PATCH_MARK)
+				&& end + PATCH_ENVELOPE + dflash[latest + end + 3] <= size) {
+			end += PATCH_ENVELOPE + dflash[latest + end + 3];
+		}
+	}
+	patch = end;
+	/* Do not write over the remains of a broken patch. */
+	if (base != latest && end < size && dflash[latest + end] != 0xff) {
+		patch = size;
+	}
 
 	/* Kick off the ISR, in case there is something to delete. */
 	state = STATE_DETECT;
@@ -1078,20 +1598,18 @@ ubyte hsk_flash_init(void xdata * const ptr, const uword __xdata size,
 	 * Restore data from the D-Flash.
 	 */
 	/* Validate the prefix. */
-	if (dflash[latest] != ident) {
+	if (dflash[base] != ident) {
 		/* Setup data envelope. */
 		memset(ptr, 0, size);
 		ptr[0] = ident;
 		return 0;
 	}
-	/* Validate the data checksum. It is the simple checksum used in the
-	 * Intel HEX (.ihx) file format. */
-	chksum = 0;
-	for (i = 0; i < size - 1; i++) {
-		chksum += dflash[latest + i];
+	/* Validate the data checksum. */
+	chksum = CHKSUM_INIT;
+	for (i = 0; i < size; i++) {
+		CHKSUM_ADD(chksum, dflash[base + i]);
 	}
-	chksum = -chksum;
-	if (dflash[latest + i] != chksum) {
+	if (chksum) {
 		/* Setup data envelope. */
 		memset(ptr, 0, size);
 		ptr[0] = ident;
@@ -1100,7 +1618,31 @@ ubyte hsk_flash_init(void xdata * const ptr, const uword __xdata size,
 
 	/* Copy data from the D-Flash to the xram. */
 	for (i = 0; i < size; i++) {
-		ptr[i] = dflash[latest + i];
+		ptr[i] = dflash[base + i];
+	}
+
+	/* Replay the latest valid patch, every patch holds all changes
+	 * since the full image was written. */
+	valid = size;
+	for (pos = 0; pos < end; pos += PATCH_ENVELOPE + len) {
+		len = dflash[latest + pos + 3];
+		chksum = CHKSUM_INIT;
+		for (i = 0; i < PATCH_ENVELOPE + len; i++) {
+			CHKSUM_ADD(chksum, dflash[latest + pos + i]);
+		}
+		if (!chksum) {
+			valid = pos;
+		}
+	}
+	if (valid < size) {
+		pos = dflash[latest + valid + 1] | (uword)dflash[latest + valid + 2] << 8;
+		len = dflash[latest + valid + 3];
+		/* Only the data between prefix and checksum may be patched. */
+		if (pos && pos + len <= size - FLASH_CHKSUM_SIZE) {
+			for (i = 0; i < len; i++) {
+				ptr[pos + i] = dflash[latest + valid + PATCH_ENVELOPE - FLASH_CHKSUM_SIZE + i];
+			}
+		}
 	}
 	return 2;
 	#undef ptr
@@ -1111,81 +1653,456 @@ ubyte hsk_flash_init(void xdata * const ptr, const uword __xdata size,
 	#undef free
 	#undef state
 	#undef ident
+	#undef base
+	#undef patch
 }
 
-bool hsk_flash_write(void) {
-	uword i;
-	ubyte chksum;
+/**
+ * Stops the state machine to prepare a write.
+ *
+ * Expects the NMIFLASH interrupt to be turned off and turns it back on.
+ * The interrupted operation is aborted by hsk_flash_start().
+ *
+ * @private
+ */
+void hsk_flash_stop(void) {
+	/*
+	 * Prepare to abort current operation.
+	 */
+	/* Return the flash timer to the default state (5µs cycle, off). */
+	SET_RMAP();
+	FCS &= ~(1 << BIT_FTEN);
+	FTVAL = 120 << BIT_OFVAL;
+	RESET_RMAP();
+	/* Now that the interrupt generating clock is turned off, it is safe
+	 * to reactivate the interrupt. */
+	NMICON |= 1 << BIT_NMIFLASH;
+}
+
+/**
+ * Starts writing an xdata range to the D-Flash.
+ *
+ * The state machine must have been stopped with hsk_flash_stop().
+ *
+ * @param pos
+ *	The D-Flash offset to write to
+ * @param ptr
+ *	The xdata range to write
+ * @param size
+ *	The number of bytes to write
+ * @private
+ */
+void hsk_flash_start(const uword pos, ubyte xdata * const ptr,
+		const uword __xdata size) {
+	/*
+	 * Update pointers for writing.
+	 */
+	flash.chksum = CHKSUM_INIT;
+	xdataDptr = ptr;
+	xdataEnd = ptr + size;
+	flashDptr = dflash + pos;
+
+	/*
+	 * Resume operation from the appropriate state.
+	 */
+	if (flash.state == STATE_IDLE) {
+		flash.state = STATE_WRITE;
+	} else {
+		flash.state = STATE_REQUEST;
+	}
+	SET_RMAP();
+	FTVAL = 120 << BIT_OFVAL;
+	FCS |= 1 << BIT_FTEN;
+	RESET_RMAP();
+}
 
+/**
+ * Wakes up the state machine, if it is idle.
+ *
+ * Expects the NMIFLASH interrupt to be turned off.
+ *
+ * @private
+ */
+void hsk_flash_wake(void) {
+	if (flash.state == STATE_IDLE) {
+		flash.state = STATE_DETECT;
+		SET_RMAP();
+		FTVAL = 120 << BIT_OFVAL;
+		FCS |= 1 << BIT_FTEN;
+		RESET_RMAP();
+	}
+}
+
+bool hsk_flash_write(void) {
 	/* Turn off the state machine, because that's the only way to
 	 * safely access the hsk_flash struct. */
 	NMICON &= ~(1 << BIT_NMIFLASH);
 
 	/*
-	 * Check for sufficient free space in the D-Flash.
+	 * Queue the write, if it cannot be started right away.
+	 *
+	 * The space check prevents a write flood in so far that the flash
+	 * can only be written as long as the state machine manages to keep
+	 * up with deleting old data. Still writing at such a rate is not
+	 * advisable.
 	 */
-	switch (flash.free) {
-	case FREE_NONE:
-		/* There is no space to write. */
+	if (flash.free == FREE_NONE || WRITING(flash.state)
+			|| (flash.free == FREE_BEHIND
+			&& (flash.wrap + flash.oldest - flash.latest - flash.size) % flash.wrap < flash.size)) {
+		/* Queued writes are merged, the state machine writes the
+		 * data as it is when the write starts. */
+		flash.pending = 1;
+		hsk_flash_wake();
 		NMICON |= 1 << BIT_NMIFLASH;
 		return 0;
-		break;
-	case FREE_BEHIND:
-		/* Check the space left to write, this prevents a write flood
-		 * in so far that the flash can only be written as long as
-		 * the state machine manages to keep up with deleting old
-		 * data. Still writing at such a rate is not advisable. */
-		if ((flash.wrap + flash.oldest - flash.latest - flash.size) % flash.wrap < flash.size) {
-			/* Insufficient. */
-			NMICON |= 1 << BIT_NMIFLASH;
-			return 0;
+	}
+
+	hsk_flash_stop();
+
+	/*
+	 * Update pointers for writing.
+	 */
+	if (flash.free == FREE_BEHIND) {
+		flash.latest = (flash.latest + flash.size) % flash.wrap;
+	}
+	flash.base = flash.latest;
+	flash.patch = 0;
+	flash.pending = 0;
+
+	hsk_flash_start(flash.latest, flash.ptr, flash.size);
+	return 1;
+}
+
+bool hsk_flash_writeDelta(void) {
+	uword i;
+	uword first;
+	uword last;
+	hsk_flash_chksum chksum;
+	ubyte len;
+
+	/*
+	 * Compare with the latest full image, validate it on the way.
+	 */
+	first = 0;
+	last = 0;
+	chksum = CHKSUM_INIT;
+	for (i = 0; i < flash.size; i++) {
+		CHKSUM_ADD(chksum, dflash[flash.base + i]);
+		if (i && i < flash.size - FLASH_CHKSUM_SIZE && dflash[flash.base + i] != flash.ptr[i]) {
+			first = first ? first : i;
+			last = i;
 		}
-		break;
+	}
+	len = first ? last - first + 1 : 0;
+
+	/* Fall back to writing a full image. */
+	if (chksum || dflash[flash.base] != flash.ident || last - first >= PATCH_DATA) {
+		return hsk_flash_write();
 	}
 
+	/* Turn off the state machine, because that's the only way to
+	 * safely access the hsk_flash struct. */
+	NMICON &= ~(1 << BIT_NMIFLASH);
+
 	/*
-	 * Prepare to abort current operation.
+	 * Check for space in the patch area.
 	 */
-	/* Return the flash timer to the default state (5µs cycle, off). */
-	SET_RMAP();
-	FCS &= ~(1 << BIT_FTEN);
-	FTVAL = 120 << BIT_OFVAL;
-	RESET_RMAP();
-	/* Now that the interrupt generating clock is turned off, it is safe
-	 * to reactivate the interrupt. */
-	NMICON |= 1 << BIT_NMIFLASH;
+	if (flash.free != FREE_BEHIND || flash.pending || WRITING(flash.state)
+			|| (flash.base == flash.latest ?
+			PATCH_ENVELOPE + len > flash.size :
+			flash.patch + PATCH_ENVELOPE + len > flash.size)) {
+		/* Write a checkpoint or merge with the ongoing write. */
+		NMICON |= 1 << BIT_NMIFLASH;
+		return hsk_flash_write();
+	}
+	/* Open a patch area behind the full image. */
+	if (flash.base == flash.latest
+			&& (flash.wrap + flash.oldest - flash.latest - flash.size) % flash.wrap < flash.size) {
+		/* Insufficient space, queue a full write. */
+		NMICON |= 1 << BIT_NMIFLASH;
+		return hsk_flash_write();
+	}
+
+	hsk_flash_stop();
 
 	/*
 	 * Update pointers for writing.
 	 */
-	if (flash.free == FREE_BEHIND) {
+	if (flash.base == flash.latest) {
 		flash.latest = (flash.latest + flash.size) % flash.wrap;
+		flash.patch = 0;
 	}
-	xdataDptr = flash.ptr;
-	flashDptr = dflash + flash.latest;
+	i = flash.latest + flash.patch;
+	flash.patch += PATCH_ENVELOPE + len;
 
 	/*
-	 * Create chksum.
+	 * Create the patch.
 	 */
-	chksum = 0;
-	for (i = 0; i < flash.size - 1; i++) {
-		chksum += flash.ptr[i];
+	delta[0] = flash.ident ^ PATCH_MARK;
+	delta[1] = first;
+	delta[2] = first >> 8;
+	delta[3] = len;
+	for (last = 0; last < len; last++) {
+		delta[PATCH_ENVELOPE - FLASH_CHKSUM_SIZE + last] = flash.ptr[first + last];
+	}
+
+	hsk_flash_start(i, delta, PATCH_ENVELOPE + len);
+	return 1;
+}
+
+/**
+ * Returns the size of the record at the given D-Flash offset.
+ *
+ * @param pos
+ *	The D-Flash offset of the record
+ * @return
+ *	The record size, 0 if there is no record
+ * @private
+ */
+ubyte hsk_flash_record_size(const uword pos) {
+	ubyte size;
+
+	if (dflash[pos] == 0xff) {
+		return 0;
+	}
+	size = dflash[pos + 1];
+	if (size < RECORD_ENVELOPE || pos % BYTES_PAGE_DFLASH + size > BYTES_PAGE_DFLASH) {
+		return 0;
+	}
+	return size;
+}
+
+void hsk_flash_record_init(void) {
+	uword page;
+	ubyte size;
+
+	/* Setup the log. */
+	flash.wrap = sizeof(dflash);
+	flash.free = FREE_BEHIND;
+	flash.state = STATE_IDLE;
+	flash.mode = MODE_RECORDS;
+	flash.pending = 0;
+	flash.callback = 0;
+	records.count = 0;
+	flashDptr = 0;
+	xdataDptr = 0;
+
+	/* Set up the NMIFLASH ISR. */
+	hsk_isr14.NMIFLASH = &hsk_flash_isr_nmiflash;
+
+	/* Find the free page behind the head of the log. */
+	for (page = 0; page < sizeof(dflash); page += BYTES_PAGE_DFLASH) {
+		if (dflash[page] == 0xff && dflash[(sizeof(dflash) + page - BYTES_PAGE_DFLASH) % sizeof(dflash)] != 0xff) {
+			break;
+		}
+	}
+
+	/* The D-Flash is entirely free. */
+	if (page >= sizeof(dflash) && dflash[0] == 0xff) {
+		flash.oldest = 0;
+		records.head = 0;
+		return;
+	}
+
+	/* No free page at all, mass delete obligatory! */
+	if (page >= sizeof(dflash)) {
+		flash.oldest = 0;
+		records.head = 0;
+		/* Kick off the ISR. */
+		flash.state = STATE_RESET;
+		NMICON |= 1 << BIT_NMIFLASH;
+		SET_RMAP();
+		FTVAL = 120 << BIT_OFVAL;
+		FCS |= 1 << BIT_FTEN;
+		RESET_RMAP();
+		return;
+	}
+
+	/* Walk right, seek the oldest page. */
+	for (flash.oldest = page; dflash[flash.oldest] == 0xff;
+		flash.oldest = (flash.oldest + BYTES_PAGE_DFLASH) % sizeof(dflash));
+
+	/* Walk through the head page, seek the end of the log. */
+	records.head = (sizeof(dflash) + page - BYTES_PAGE_DFLASH) % sizeof(dflash);
+	do {
+		size = hsk_flash_record_size(records.head);
+		records.head += size;
+	} while (size && records.head % BYTES_PAGE_DFLASH);
+	/* Do not write over the remains of a broken record. */
+	if (records.head % BYTES_PAGE_DFLASH && dflash[records.head] != 0xff) {
+		records.head += BYTES_PAGE_DFLASH - records.head % BYTES_PAGE_DFLASH;
+	}
+	records.head %= sizeof(dflash);
+}
+
+ubyte hsk_flash_record_open(const ubyte id, void xdata * const ptr,
+		const ubyte __xdata size) {
+	ubyte xdata * const bytes = ptr;
+	uword pos;
+	ubyte i;
+	ubyte len;
+	hsk_flash_chksum chksum;
+
+	#define record    records.list[records.count]
+	if (records.count >= FLASH_RECORDS || id == 0xff
+			|| size < RECORD_ENVELOPE || size > BYTES_PAGE_DFLASH) {
+		return FLASH_PWR_FIRST;
+	}
+	record.ptr = ptr;
+	record.size = size;
+	record.id = id;
+	record.pending = 0;
+	record.pos = RECORD_NONE;
+
+	/* Walk through the log, seek the latest valid copy. */
+	for (pos = flash.oldest; pos != records.head;
+		pos = (pos + len) % sizeof(dflash)) {
+		len = hsk_flash_record_size(pos);
+		if (!len) {
+			/* Continue with the next page. */
+			len = BYTES_PAGE_DFLASH - pos % BYTES_PAGE_DFLASH;
+			continue;
+		}
+		if (dflash[pos] != id || len != size) {
+			continue;
+		}
+		/* Validate the data checksum. */
+		chksum = CHKSUM_INIT;
+		for (i = 0; i < size; i++) {
+			CHKSUM_ADD(chksum, dflash[pos + i]);
+		}
+		if (!chksum) {
+			record.pos = pos;
+		}
+	}
+	#undef record
+
+	/* Register the record. */
+	pos = records.list[records.count].pos;
+	records.count++;
+
+	/* Check whether XRAM data is consistent. */
+	if (bytes[0] == id && bytes[1] == size) {
+		return FLASH_PWR_RESET;
+	}
+
+	/* Copy data from the D-Flash to the xram. */
+	if (pos != RECORD_NONE) {
+		for (i = 0; i < size; i++) {
+			bytes[i] = dflash[pos + i];
+		}
+		return FLASH_PWR_ON;
+	}
+
+	/* Setup data envelope. */
+	memset(ptr, 0, size);
+	bytes[0] = id;
+	bytes[1] = size;
+	return FLASH_PWR_FIRST;
+}
+
+bool hsk_flash_record_write(const ubyte id) {
+	ubyte i;
+
+	/* Find the record. */
+	for (i = 0; i < records.count && records.list[i].id != id; i++);
+	if (i >= records.count) {
+		return 0;
+	}
+
+	/* Turn off the state machine, because that's the only way to
+	 * safely access the records. */
+	NMICON &= ~(1 << BIT_NMIFLASH);
+	if (!records.list[i].pending) {
+		records.list[i].pending = 1;
+		flash.pending++;
+	}
+	hsk_flash_wake();
+	NMICON |= 1 << BIT_NMIFLASH;
+	return 1;
+}
+
+/*
+ * SDCC does not like the code keyword for function pointers, C51 needs it
+ * or it will use generic pointers.
+ */
+#ifdef SDCC
+	#undef code
+	#define code
+#endif /* SDCC */
+
+void hsk_flash_callback(const void (code * const __xdata callback)
+                                   (void) using(2)) {
+	/* Turn off the state machine, because that's the only way to
+	 * safely access the hsk_flash struct. */
+	NMICON &= ~(1 << BIT_NMIFLASH);
+	flash.callback = callback;
+	NMICON |= 1 << BIT_NMIFLASH;
+}
+
+
+bool hsk_flash_pflash_init(void) {
+	/* Turn off the state machine, because that's the only way to
+	 * safely access the hsk_flash struct. */
+	NMICON &= ~(1 << BIT_NMIFLASH);
+	/* Refuse while the D-Flash is busy or has writes pending, they
+	 * would be lost. */
+	if (flash.state != STATE_IDLE || flash.pending) {
+		NMICON |= 1 << BIT_NMIFLASH;
+		return 0;
+	}
+
+	flash.mode = MODE_PFLASH;
+	flash.pending = 0;
+	flash.callback = 0;
+	flash.chksum = CHKSUM_INIT;
+	flashDptr = 0;
+	xdataDptr = 0;
+
+	/* Set up the NMIFLASH ISR. */
+	hsk_isr14.NMIFLASH = &hsk_flash_isr_nmiflash;
+	NMICON |= 1 << BIT_NMIFLASH;
+	return 1;
+}
+
+bool hsk_flash_pflash_write(const uword addr, ubyte xdata * const ptr) {
+	if (addr % BYTES_WORDLINE_PFLASH || addr >= LEN_PFLASH) {
+		return 0;
+	}
+
+	/* Turn off the state machine, because that's the only way to
+	 * safely access the hsk_flash struct. */
+	NMICON &= ~(1 << BIT_NMIFLASH);
+	if (flash.mode != MODE_PFLASH || flash.state != STATE_IDLE) {
+		NMICON |= 1 << BIT_NMIFLASH;
+		return 0;
 	}
-	chksum = -chksum;
-	flash.ptr[flash.size - 1] = chksum;
 
 	/*
-	 * Resume operation from the appropriate state.
+	 * Update pointers for writing, the checksum keeps running.
 	 */
-	if (flash.state == STATE_IDLE) {
-		flash.state = STATE_WRITE;
-	} else {
-		flash.state = STATE_REQUEST;
-	}
+	xdataDptr = ptr;
+	xdataEnd = ptr + BYTES_WORDLINE_PFLASH;
+	flashDptr = (ubyte code *)(ADDR_PFLASH + addr);
+
+	/* The first wordline of a page requires deleting the page. */
+	flash.state = addr % BYTES_PAGE_PFLASH ? STATE_WRITE : STATE_DELETE;
 	SET_RMAP();
 	FTVAL = 120 << BIT_OFVAL;
 	FCS |= 1 << BIT_FTEN;
 	RESET_RMAP();
+	NMICON |= 1 << BIT_NMIFLASH;
 	return 1;
 }
 
+bool hsk_flash_pflash_busy(void) {
+	return flash.state != STATE_IDLE;
+}
+
+uword hsk_flash_pflash_chksum(void) {
+	uword chksum;
+	NMICON &= ~(1 << BIT_NMIFLASH);
+	chksum = flash.chksum;
+	NMICON |= 1 << BIT_NMIFLASH;
+	return chksum;
+}
@@ -7,6 +7,10 @@
  * It provides the \ref FLASH_STRUCT_FACTORY to create a struct with data that
  * can be stored with hsk_flash_write() and recovered with hsk_flash_init().
  *
+ * Alternatively the \ref FLASH_RECORD_FACTORY creates records, several of
+ * which can be kept in the D-Flash and written independently of each
+ * other, see hsk_flash_record_init().
+ *
  * The D-Flash is used as a ring buffer, this distributes writes over the
  * entire flash to gain the maximum achievable lifetime. The lifetime
  * expectancy depends on your usage scenario and the size of the struct.
@@ -30,11 +34,32 @@
  *	- Round down to the next smaller integer
  *
  * E.g. to store 20 bytes of configuration data, the struct factory adds 2
- * bytes overhead to be able to check the consistency of written data, so
- * \f$ sizeof(struct) = 22 \f$.  Expecting that most of the µC use is
- * within the first year, table 20 suggests that
- * \f$ expectedcycles = 100000 \f$. In that case the expected number of
- * possible hsk_flash_write() calls is 18.6 million.
+ * bytes overhead (3 with \c FLASH_CRC) to be able to check the
+ * consistency of written data, so \f$ sizeof(struct) = 22 \f$.  Expecting
+ * that most of the µC use is within the first year, table 20 suggests
+ * that \f$ expectedcycles = 100000 \f$. In that case the expected number
+ * of possible hsk_flash_write() calls is 18.6 million.
+ *
+ * Small changes to large structs can be written with
+ * hsk_flash_writeDelta(), which only writes the changed bytes.
+ *
+ * Writes that cannot be started right away are queued and merged, the
+ * completion of all queued writes can be reported by a callback function,
+ * see hsk_flash_callback().
+ *
+ * Data is validated with an 8 bit checksum by default. Defining
+ * \c FLASH_CRC at build time replaces it with a 2 byte CRC-16 from the
+ * hsk_crc library, which detects all burst errors up to 16 bits and all
+ * errors of up to 3 bits in the D-Flash:
+ * \code
+ * CFLAGS+=	-DFLASH_CRC
+ * \endcode
+ * The CRC is computed while writing by the state machine, so writes do
+ * not take longer. Switching this option invalidates all data in the
+ * D-Flash.
+ *
+ * Bootloaders can use the same state machine to program the P-Flash
+ * wordline by wordline, see hsk_flash_pflash_init().
  *
  * @author kami
  *
@@ -94,6 +119,22 @@
 #include "../hsk_isr/hsk_isr.isr"
 #endif /* SDCC */
 
+/*
+ * C51 does not include the used register bank in pointer types.
+ */
+#ifdef __C51__
+	#define using(bank)
+#endif
+
+/*
+ * SDCC does not like the \c code keyword for function pointers, C51 needs it
+ * or it will use generic pointers.
+ */
+#ifdef SDCC
+	#undef code
+	#define code
+#endif /* SDCC */
+
 /**
  * Ensure that a flash memory layout is defined.
  *
@@ -104,6 +145,20 @@
 #define XC878_16FF
 #endif
 
+#ifdef FLASH_CRC
+/**
+ * The number of bytes of the checksum at the end of structs, records and
+ * patches, 2 bytes for the CRC-16.
+ */
+#define FLASH_CHKSUM_SIZE    2
+#else
+/**
+ * The number of bytes of the checksum at the end of structs, records and
+ * patches.
+ */
+#define FLASH_CHKSUM_SIZE    1
+#endif
+
 /**
  * Used to create a struct that can be used with the hsk_flash_init()
  * function.
@@ -142,7 +197,58 @@
 		 *
 		 * @private
 		 */\
-		ubyte hsk_flash_chksum;\
+		ubyte hsk_flash_chksum[FLASH_CHKSUM_SIZE];\
+	} xdata
+
+/**
+ * Used to create a record struct that can be used with the
+ * hsk_flash_record_open() function.
+ *
+ * Records work like structs created with \ref FLASH_STRUCT_FACTORY,
+ * but the envelope carries a record ID and the record size. The
+ * following example shows how to create a record named calibration:
+ * \code
+ * FLASH_RECORD_FACTORY(
+ * 	uword offset;
+ * 	uword gain;
+ * ) calibration;
+ * \endcode
+ *
+ * The envelope adds 3 bytes (4 with \c FLASH_CRC), a record may not
+ * exceed 64 bytes including the envelope.
+ *
+ * @param members
+ *	Struct member definitions
+ */
+#define FLASH_RECORD_FACTORY(members) \
+	/**
+	 * This struct is a template for records that can be written to the
+	 * D-Flash. It is created by invoking the \ref FLASH_RECORD_FACTORY
+	 * macro.
+	 */\
+	volatile struct {\
+		/**
+		 * The record ID.
+		 *
+		 * @private
+		 */\
+		ubyte hsk_flash_id;\
+		\
+		/**
+		 * The record size, including the envelope.
+		 *
+		 * @private
+		 */\
+		ubyte hsk_flash_size;\
+		\
+		members\
+		\
+		/**
+		 * For data integrity detection.
+		 *
+		 * @private
+		 */\
+		ubyte hsk_flash_chksum[FLASH_CHKSUM_SIZE];\
 	} xdata
 
 /**
@@ -211,15 +317,244 @@ ubyte hsk_flash_init(void xdata * const ptr, const uword __xdata size,
 /**
  * Writes the current data to the D-Flash.
  *
- * Ongoing writes are interrupted. Ongoing deletes are interrupted unless
- * there is insufficient space left to write the data.
+ * Ongoing deletes are interrupted unless there is insufficient space left
+ * to write the data.
+ *
+ * If a write is already ongoing or there is insufficient space, the write
+ * is queued. The queued write is started by the state machine once the
+ * ongoing write is complete and there is enough space. Several calls
+ * in the meantime are merged into a single write of the data as it is
+ * when the write starts. So there is no need to call this again.
+ *
+ * The data is read from the struct byte by byte while it is written, and
+ * the checksum is computed from the same bytes. Changes made to the
+ * struct during a write result in an image that mixes old and new values
+ * and still passes the checksum. So the struct must not be modified
+ * until the callback set with hsk_flash_callback() reports completion.
  *
  * @retval 1
  *	The D-Flash write is on the way
  * @retval 0
- *	Not enough free D-Flash space to write, try again later
+ *	The D-Flash write is queued
  */
 bool hsk_flash_write(void);
 
+/**
+ * Writes the changes since the latest full image to the D-Flash.
+ *
+ * The changed bytes are appended as a small patch to a patch area in the
+ * block behind the latest full image. Every patch holds all the changes
+ * since the full image was written, so hsk_flash_init() only needs to
+ * replay the latest valid patch.
+ *
+ * A full image is written by calling hsk_flash_write() instead, if
+ * - the latest full image is not valid
+ * - the changed bytes span more than 16 bytes
+ * - the patch area is full, which provides a periodic checkpoint
+ *
+ * Every patch has an overhead of 5 bytes (6 with \c FLASH_CRC). E.g.
+ * incrementing a counter in a 100 byte struct writes a 6 byte patch, so
+ * 16 increments fit into a patch area before the next full image is
+ * written. This stretches the expected number of writes by a factor
+ * of ~8.
+ *
+ * If a write is ongoing or queued, or there is insufficient space to
+ * open a new patch area, a full image is queued by calling
+ * hsk_flash_write().
+ *
+ * The same restriction as for hsk_flash_write() applies, the struct must
+ * not be modified before the patch is complete.
+ *
+ * @retval 1
+ *	The D-Flash write is on the way
+ * @retval 0
+ *	The D-Flash write is queued
+ */
+bool hsk_flash_writeDelta(void);
+
+/**
+ * Sets up the D-Flash as a log of records.
+ *
+ * The record log is an alternative to hsk_flash_init(), the two cannot
+ * be used together, because both use the entire D-Flash.
+ *
+ * Every record is written to the head of the log, records that change
+ * frequently do not cause other records to be written. Pages are only
+ * deleted when the log runs out of space. Before the oldest page is
+ * deleted, the records whose latest copy resides in that page are
+ * written to the head of the log again.
+ *
+ * The total size of all records should not exceed half of the D-Flash,
+ * otherwise most of the writes are spent on moving records out of the
+ * way.
+ *
+ * All records have to be opened with hsk_flash_record_open() before
+ * the first call of hsk_flash_record_write(). Records in the D-Flash
+ * that are not opened are discarded when their page is deleted.
+ */
+void hsk_flash_record_init(void);
+
+/**
+ * Recovers a record from a previous session and registers it for
+ * storage of changes.
+ *
+ * Recovery works like in hsk_flash_init(), the latest valid copy of the
+ * record with the given ID and size is recovered from the D-Flash.
+ *
+ * If the record cannot be registered, because the ID is 0xff, the size
+ * is out of range or \c FLASH_RECORDS records are already open,
+ * \ref FLASH_PWR_FIRST is returned and the record cannot be written.
+ *
+ * @param id
+ *	The record ID, in the range [0x00; 0xfe]
+ * @param ptr
+ *	A pointer to the xdata record created with
+ *	\ref FLASH_RECORD_FACTORY
+ * @param size
+ *	The size of the record
+ * @retval FLASH_PWR_FIRST
+ *	No valid data was recovered
+ * @retval FLASH_PWR_RESET
+ *	Continue operation after a reset
+ * @retval FLASH_PWR_ON
+ *	Data restore from the D-Flash succeeded
+ */
+ubyte hsk_flash_record_open(const ubyte id, void xdata * const ptr,
+		const ubyte __xdata size);
+
+/**
+ * Queues a record for writing to the D-Flash.
+ *
+ * Records are written one at a time in the background. If the record
+ * is queued again before it was written, it is only written once.
+ *
+ * The record is read while it is written, so it must not be modified
+ * until the completion callback is called, see hsk_flash_write().
+ *
+ * @param id
+ *	The ID of the record to write
+ * @retval 1
+ *	The record is queued for writing
+ * @retval 0
+ *	No record with the given ID was opened
+ */
+bool hsk_flash_record_write(const ubyte id);
+
+/**
+ * Sets a function to call back when all queued writes are complete.
+ *
+ * The callback function is called from the NMI state machine, i.e. after
+ * the last queued hsk_flash_write() or hsk_flash_record_write() made it
+ * into the D-Flash. It is called with the RMAP bit cleared and register
+ * bank 2, so SFR paging must use SST3/RST3.
+ *
+ * Data written to the D-Flash may be modified again once the callback
+ * function has been called.
+ *
+ * Set the callback function after hsk_flash_init() or
+ * hsk_flash_record_init(), both reset it.
+ *
+ * @param callback
+ *	The function to call back, 0 to turn callbacks off
+ */
+void hsk_flash_callback(const void (code * const __xdata callback)
+                                   (void) using(2));
+
+/**
+ * Sets up the state machine to program the P-Flash.
+ *
+ * This is meant for bootloaders that receive an application image, e.g.
+ * over CAN, and program it while the next wordline is still arriving.
+ * The D-Flash cannot be used at the same time, so this replaces
+ * hsk_flash_init() and hsk_flash_record_init(). The switch is refused
+ * while a D-Flash operation is ongoing or D-Flash writes are queued,
+ * use the callback set with hsk_flash_callback() to wait for them.
+ *
+ * To return to the D-Flash, wait until hsk_flash_pflash_busy() returns
+ * 0 and call hsk_flash_init() or hsk_flash_record_init() again.
+ *
+ * A P-Flash bank cannot be read while it is being programmed. The code
+ * calling this, the NMI handler and the interrupt vectors must not be
+ * located in the P-Flash bank that is being programmed.
+ *
+ * Setting a callback function with hsk_flash_callback() after this
+ * call provides a notification when a wordline was written.
+ *
+ * @retval 1
+ *	The state machine is set up to program the P-Flash
+ * @retval 0
+ *	The D-Flash is busy or has queued writes
+ */
+bool hsk_flash_pflash_init(void);
+
+/**
+ * Programs a P-Flash wordline in the background.
+ *
+ * The wordline is programmed by the NMI state machine, the CPU remains
+ * available to receive the next wordline into a second buffer. If the
+ * address is the start of a P-Flash page, the page is erased first.
+ * So the pages of an image need to be written in order.
+ *
+ * The state machine keeps a running checksum or CRC of all bytes it
+ * programmed, see hsk_flash_pflash_chksum().
+ *
+ * @param addr
+ *	The P-Flash address to write to, must be aligned to a wordline
+ *	(64 bytes)
+ * @param ptr
+ *	The wordline data, 64 bytes, must not be changed before the write
+ *	is complete
+ * @retval 1
+ *	The P-Flash write is on the way
+ * @retval 0
+ *	The address is invalid, the state machine was not set up with
+ *	hsk_flash_pflash_init() or it is still busy
+ */
+bool hsk_flash_pflash_write(const uword addr, ubyte xdata * const ptr);
+
+/**
+ * Returns whether a P-Flash operation is ongoing.
+ *
+ * @retval 1
+ *	A wordline is being programmed or a page is being erased
+ * @retval 0
+ *	The next wordline can be written
+ */
+bool hsk_flash_pflash_busy(void);
+
+/**
+ * Returns the checksum of all bytes programmed since
+ * hsk_flash_pflash_init().
+ *
+ * A bootloader can compare this to the checksum of the transmitted
+ * image before jumping into the application. With \c FLASH_CRC this is
+ * the CRC-16 of the image as computed by hsk_crc_block().
+ *
+ * By default, without \c FLASH_CRC, this is only the 8 bit sum of all
+ * bytes widened to 16 bits. It does not detect swapped bytes and
+ * misses many multi-bit errors, so bootloaders should be built with
+ * \c FLASH_CRC.
+ *
+ * @return
+ *	The CRC-16 of all programmed bytes with \c FLASH_CRC, their 8 bit
+ *	sum otherwise
+ */
+uword hsk_flash_pflash_chksum(void);
+
+/*
+ * Restore the usual meaning of \c code.
+ */
+#ifdef SDCC
+	#undef code
+	#define code	__code
+#endif /* SDCC */
+
+/*
+ * Restore the usual meaning of \c using(bank).
+ */
+#ifdef __C51__
+	#undef using
+#endif /* __C51__ */
+
 #endif /* _HSK_PERSIST_H_ */
 
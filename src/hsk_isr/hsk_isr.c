@@ -20,12 +20,139 @@
  * | 34         | ISR: Backup RMAP              | …             | 3 x 2 + 4
  * | 44         | ISR: Reset RMAP               | …             | 2 x 2 + 4
  * | 52         | ISR: Select callback          | …             | …
+ *
+ * \section isr_sources Interrupt Source Filter
+ *
+ * Every shared ISR tests the request flags of all its interrupt sources
+ * and calls back the function registered for every set flag. Sources
+ * that no library registers a callback for still cost a flag test and
+ * possibly an SFR page switch per interrupt.
+ *
+ * If \c ISR_SOURCES is defined at build time, the list of used interrupt
+ * sources is taken from the header \c isr_sources.h instead. The ISRs
+ * only test the sources named in this list, everything else is compiled
+ * out, including the SFR page switches of unused groups.
+ * The list contains a define ISRn_SOURCE for every used source, e.g.
+ * \c ISR9_EXINT3 for hsk_isr9.EXINT3.
+ *
+ * The \c isr target of the \c Makefile generates the list in the
+ * \c gen/ directory from the callbacks registered in \c src/:
+ * \code
+ * make isr
+ * \endcode
+ * Use it by adding the following line to the \c Makefile.local:
+ * \code
+ * CFLAGS+=	-DISR_SOURCES
+ * \endcode
+ *
+ * Sources are still tested in the same order, so the priority among the
+ * sources of a shared ISR does not change.
+ *
+ * The list only covers the callbacks registered by the code in \c src/.
+ * Sources missing from the list are not tested, so their request flags
+ * are never cleared. If such a source is enabled, its request keeps the
+ * shared ISR pending and the ISR is re-entered forever. So the list must
+ * be regenerated after adding code that registers callbacks, and code
+ * outside of \c src/ must not register callbacks for other sources.
+ *
+ * \section isr_stats Callback Instrumentation
+ *
+ * If \c ISR_STATS is defined at build time, every callback is timed by
+ * taking a time stamp before and after the call, see hsk_isr_stats_get().
+ * Without \c ISR_STATS the callbacks are called directly, so the
+ * instrumentation costs nothing.
  */
 
 #include <Infineon/XC878.h>
 
 #include "hsk_isr.h"
 
+/*
+ * Get the list of used interrupt sources.
+ */
+#ifdef ISR_SOURCES
+#include <isr_sources.h>
+#else
+/*
+ * Use all interrupt sources.
+ */
+#define ISR5_TF2
+#define ISR5_EXF2
+#define ISR5_CCTOVF
+#define ISR5_NDOV
+#define ISR5_EOFSYN
+#define ISR5_ERRSYN
+#define ISR5_CANSRC0
+#define ISR6_CANSRC1
+#define ISR6_CANSRC2
+#define ISR6_ADCSR0
+#define ISR6_ADCSR1
+#define ISR8_EXINT2
+#define ISR8_NDOV
+#define ISR8_RI
+#define ISR8_TI
+#define ISR8_TF2
+#define ISR8_EXF2
+#define ISR8_EOC
+#define ISR8_IRDY
+#define ISR8_IERR
+#define ISR9_EXINT3
+#define ISR9_EXINT4
+#define ISR9_EXINT5
+#define ISR9_EXINT6
+#define ISR9_CANSRC3
+#define ISR14_NMIWDT
+#define ISR14_NMIPLL
+#define ISR14_NMIFLASH
+#define ISR14_NMIVDDP
+#define ISR14_NMIECC
+#endif /* ISR_SOURCES */
+
+#ifdef ISR_STATS
+/**
+ * The execution time statistics of all callbacks.
+ */
+static volatile struct hsk_isr_stats xdata timing[ISR_STATS_COUNT];
+
+/**
+ * Calls back an interrupt source and records the execution time.
+ *
+ * RMAP is reset after the callback, because the time stamp might be
+ * taken from an unmapped SFR.
+ *
+ * @param callback
+ *	The callback function pointer
+ * @param source
+ *	The interrupt source, one of ISR_STATS_*
+ */
+#define ISR_CALL(callback, source) { \
+	uword start, time; \
+	ISR_STATS_TIMER(start); \
+	callback(); \
+	RESET_RMAP(); \
+	ISR_STATS_TIMER(time); \
+	time -= start; \
+	if (!timing[source].count || time < timing[source].min) { \
+		timing[source].min = time; \
+	} \
+	if (time > timing[source].max) { \
+		timing[source].max = time; \
+	} \
+	timing[source].count++; \
+	timing[source].total += time; \
+}
+#else /* ISR_STATS */
+/**
+ * Calls back an interrupt source.
+ *
+ * @param callback
+ *	The callback function pointer
+ * @param source
+ *	The interrupt source, unused
+ */
+#define ISR_CALL(callback, source)    callback()
+#endif /* ISR_STATS */
+
 /**
  * This is a dummy function used for putting register bank 1 using ISRs
  * into a common call tree for C51.
@@ -115,42 +242,64 @@ void ISR_hsk_isr5(void) interrupt 5 using 1 {
 	bool rmap = (SYSCON0 >> BIT_RMAP) & 1;
 	RESET_RMAP();
 
+#if defined ISR5_TF2 \
+    || defined ISR5_EXF2
 	SFR_PAGE(_t2_0, SST0);
+#ifdef ISR5_TF2
 	if (T2_T2CON & (1 << BIT_TF2)) {
 		T2_T2CON &= ~(1 << BIT_TF2);
-		hsk_isr5.TF2();
+		ISR_CALL(hsk_isr5.TF2, ISR_STATS_5_TF2);
 	}
+#endif
+#ifdef ISR5_EXF2
 	if (T2_T2CON & (1 << BIT_EXF2)) {
 		T2_T2CON &= ~(1 << BIT_EXF2);
-		hsk_isr5.EXF2();
+		ISR_CALL(hsk_isr5.EXF2, ISR_STATS_5_EXF2);
 	}
+#endif
 	SFR_PAGE(_t2_0, RST0);
+#endif
 
+#ifdef ISR5_CCTOVF
 	SFR_PAGE(_t2_1, SST0);
 	if (T2CCU_CCTCON & (1 << BIT_CCTOVF)) {
 		T2CCU_CCTCON &= ~(1 << BIT_CCTOVF);
-		hsk_isr5.CCTOVF();
+		ISR_CALL(hsk_isr5.CCTOVF, ISR_STATS_5_CCTOVF);
 	}
 	SFR_PAGE(_t2_2, RST0);
+#endif
 
+#if defined ISR5_NDOV \
+    || defined ISR5_EOFSYN \
+    || defined ISR5_ERRSYN \
+    || defined ISR5_CANSRC0
 	SFR_PAGE(_su0, SST0);
+#ifdef ISR5_NDOV
 	if (FDCON & (1 << BIT_NDOV)) {
 		FDCON &= ~(1 << BIT_NDOV);
-		hsk_isr5.NDOV();
+		ISR_CALL(hsk_isr5.NDOV, ISR_STATS_5_NDOV);
 	}
+#endif
+#ifdef ISR5_EOFSYN
 	if (FDCON & (1 << BIT_EOFSYN)) {
 		FDCON &= ~(1 << BIT_EOFSYN);
-		hsk_isr5.EOFSYN();
+		ISR_CALL(hsk_isr5.EOFSYN, ISR_STATS_5_EOFSYN);
 	}
+#endif
+#ifdef ISR5_ERRSYN
 	if (FDCON & (1 << BIT_ERRSYN)) {
 		FDCON &= ~(1 << BIT_ERRSYN);
-		hsk_isr5.ERRSYN();
+		ISR_CALL(hsk_isr5.ERRSYN, ISR_STATS_5_ERRSYN);
 	}
+#endif
+#ifdef ISR5_CANSRC0
 	if (IRCON2 & (1 << BIT_CANSRC0)) {
 		FDCON &= ~(1 << BIT_CANSRC0);
-		hsk_isr5.CANSRC0();
+		ISR_CALL(hsk_isr5.CANSRC0, ISR_STATS_5_CANSRC0);
 	}
+#endif
 	SFR_PAGE(_su0, RST0);
+#endif
 
 	rmap ? (SET_RMAP()) : (RESET_RMAP());
 }
@@ -197,24 +346,37 @@ void ISR_hsk_isr6(void) interrupt 6 using 1 {
 	bool rmap = (SYSCON0 >> BIT_RMAP) & 1;
 	RESET_RMAP();
 
+#if defined ISR6_CANSRC1 \
+    || defined ISR6_CANSRC2 \
+    || defined ISR6_ADCSR0 \
+    || defined ISR6_ADCSR1
 	SFR_PAGE(_su0, SST0);
+#ifdef ISR6_CANSRC1
 	if (IRCON1 & (1 << BIT_CANSRC1)) {
 		IRCON1 &= ~(1 << BIT_CANSRC1);
-		hsk_isr6.CANSRC1();
+		ISR_CALL(hsk_isr6.CANSRC1, ISR_STATS_6_CANSRC1);
 	}
+#endif
+#ifdef ISR6_CANSRC2
 	if (IRCON1 & (1 << BIT_CANSRC2)) {
 		IRCON1 &= ~(1 << BIT_CANSRC2);
-		hsk_isr6.CANSRC2();
+		ISR_CALL(hsk_isr6.CANSRC2, ISR_STATS_6_CANSRC2);
 	}
+#endif
+#ifdef ISR6_ADCSR0
 	if (IRCON1 & (1 << BIT_ADCSR0)) {
 		IRCON1 &= ~(1 << BIT_ADCSR0);
-		hsk_isr6.ADCSR0();
+		ISR_CALL(hsk_isr6.ADCSR0, ISR_STATS_6_ADCSR0);
 	}
+#endif
+#ifdef ISR6_ADCSR1
 	if (IRCON1 & (1 << BIT_ADCSR1)) {
 		IRCON1 &= ~(1 << BIT_ADCSR1);
-		hsk_isr6.ADCSR1();
+		ISR_CALL(hsk_isr6.ADCSR1, ISR_STATS_6_ADCSR1);
 	}
+#endif
 	SFR_PAGE(_su0, RST0);
+#endif
 
 	rmap ? (SET_RMAP()) : (RESET_RMAP());
 }
@@ -292,46 +454,70 @@ void ISR_hsk_isr8(void) interrupt 8 using 1 {
 	bool rmap = (SYSCON0 >> BIT_RMAP) & 1;
 	RESET_RMAP();
 
+#if defined ISR8_EXINT2 \
+    || defined ISR8_NDOV
 	SFR_PAGE(_su0, SST0);
+#ifdef ISR8_EXINT2
 	if (IRCON0 & (1 << BIT_EXINT2)) {
-		hsk_isr8.EXINT2();
+		ISR_CALL(hsk_isr8.EXINT2, ISR_STATS_8_EXINT2);
 	}
+#endif
+#ifdef ISR8_NDOV
 	if (FDCON & (1 << BIT_NDOV)) {
-		hsk_isr8.NDOV();
+		ISR_CALL(hsk_isr8.NDOV, ISR_STATS_8_NDOV);
 	}
+#endif
 	SFR_PAGE(_su0, RST0);
+#endif
 
+#ifdef ISR8_RI
 	if (SCON & (1 << BIT_RI)) {
-		hsk_isr8.RI();
+		ISR_CALL(hsk_isr8.RI, ISR_STATS_8_RI);
 	}
+#endif
+#ifdef ISR8_TI
 	if (SCON & (1 << BIT_TI)) {
-		hsk_isr8.TI();
+		ISR_CALL(hsk_isr8.TI, ISR_STATS_8_TI);
 	}
+#endif
 
+#if defined ISR8_TF2 \
+    || defined ISR8_EXF2
 	SFR_PAGE(_t2_0, SST0);
+#ifdef ISR8_TF2
 	if (T2_T2CON & (1 << BIT_TF2)) {
-		hsk_isr8.TF2();
+		ISR_CALL(hsk_isr8.TF2, ISR_STATS_8_TF2);
 	}
+#endif
+#ifdef ISR8_EXF2
 	if (T2_T2CON & (1 << BIT_EXF2)) {
-		hsk_isr8.EXF2();
+		ISR_CALL(hsk_isr8.EXF2, ISR_STATS_8_EXF2);
 	}
+#endif
 	SFR_PAGE(_t2_0, RST0);
+#endif
 
+#ifdef ISR8_EOC
 	SET_RMAP();
 	if (CD_STATC & (1 << BIT_EOC)) {
 		RESET_RMAP();
-		hsk_isr8.EOC();
+		ISR_CALL(hsk_isr8.EOC, ISR_STATS_8_EOC);
 	}
+#endif
+#ifdef ISR8_IRDY
 	SET_RMAP();
 	if (MDU_MDUSTAT & (1 << BIT_IRDY)) {
 		RESET_RMAP();
-		hsk_isr8.IRDY();
+		ISR_CALL(hsk_isr8.IRDY, ISR_STATS_8_IRDY);
 	}
+#endif
+#ifdef ISR8_IERR
 	SET_RMAP();
 	if (MDU_MDUSTAT & (1 << BIT_IERR)) {
 		RESET_RMAP();
-		hsk_isr8.IERR();
+		ISR_CALL(hsk_isr8.IERR, ISR_STATS_8_IERR);
 	}
+#endif
 
 	rmap ? (SET_RMAP()) : (RESET_RMAP());
 }
@@ -388,28 +574,44 @@ void ISR_hsk_isr9(void) interrupt 9 using 1 {
 	bool rmap = (SYSCON0 >> BIT_RMAP) & 1;
 	RESET_RMAP();
 
+#if defined ISR9_EXINT3 \
+    || defined ISR9_EXINT4 \
+    || defined ISR9_EXINT5 \
+    || defined ISR9_EXINT6 \
+    || defined ISR9_CANSRC3
 	SFR_PAGE(_su0, SST0);
+#ifdef ISR9_EXINT3
 	if (IRCON0 & (1 << BIT_EXINT3)) {
 		IRCON0 &= ~(1 << BIT_EXINT3);
-		hsk_isr9.EXINT3();
+		ISR_CALL(hsk_isr9.EXINT3, ISR_STATS_9_EXINT3);
 	}
+#endif
+#ifdef ISR9_EXINT4
 	if (IRCON0 & (1 << BIT_EXINT4)) {
 		IRCON0 &= ~(1 << BIT_EXINT4);
-		hsk_isr9.EXINT4();
+		ISR_CALL(hsk_isr9.EXINT4, ISR_STATS_9_EXINT4);
 	}
+#endif
+#ifdef ISR9_EXINT5
 	if (IRCON0 & (1 << BIT_EXINT5)) {
 		IRCON0 &= ~(1 << BIT_EXINT5);
-		hsk_isr9.EXINT5();
+		ISR_CALL(hsk_isr9.EXINT5, ISR_STATS_9_EXINT5);
 	}
+#endif
+#ifdef ISR9_EXINT6
 	if (IRCON0 & (1 << BIT_EXINT6)) {
 		IRCON0 &= ~(1 << BIT_EXINT6);
-		hsk_isr9.EXINT6();
+		ISR_CALL(hsk_isr9.EXINT6, ISR_STATS_9_EXINT6);
 	}
+#endif
+#ifdef ISR9_CANSRC3
 	if (IRCON2 & (1 << BIT_CANSRC3)) {
 		IRCON1 &= ~(1 << BIT_CANSRC3);
-		hsk_isr9.CANSRC3();
+		ISR_CALL(hsk_isr9.CANSRC3, ISR_STATS_9_CANSRC3);
 	}
+#endif
 	SFR_PAGE(_su0, RST0);
+#endif
 
 	rmap ? (SET_RMAP()) : (RESET_RMAP());
 }
@@ -460,29 +662,80 @@ void ISR_hsk_isr14(void) interrupt 14 using 2 {
 	bool rmap = (SYSCON0 >> BIT_RMAP) & 1;
 	RESET_RMAP();
 
+#if defined ISR14_NMIWDT \
+    || defined ISR14_NMIPLL \
+    || defined ISR14_NMIFLASH \
+    || defined ISR14_NMIVDDP \
+    || defined ISR14_NMIECC
 	SFR_PAGE(_su0, SST2);
+#ifdef ISR14_NMIWDT
 	if (NMISR & (1 << BIT_NMIWDT)) {
 		NMISR &= ~(1 << BIT_NMIWDT);
-		hsk_isr14.NMIWDT();
+		ISR_CALL(hsk_isr14.NMIWDT, ISR_STATS_14_NMIWDT);
 	}
+#endif
+#ifdef ISR14_NMIPLL
 	if (NMISR & (1 << BIT_NMIPLL)) {
 		NMISR &= ~(1 << BIT_NMIPLL);
-		hsk_isr14.NMIPLL();
+		ISR_CALL(hsk_isr14.NMIPLL, ISR_STATS_14_NMIPLL);
 	}
+#endif
+#ifdef ISR14_NMIFLASH
 	if (NMISR & (1 << BIT_NMIFLASH)) {
 		NMISR &= ~(1 << BIT_NMIFLASH);
-		hsk_isr14.NMIFLASH();
+		ISR_CALL(hsk_isr14.NMIFLASH, ISR_STATS_14_NMIFLASH);
 	}
+#endif
+#ifdef ISR14_NMIVDDP
 	if (NMISR & (1 << BIT_NMIVDDP)) {
 		NMISR &= ~(1 << BIT_NMIVDDP);
-		hsk_isr14.NMIVDDP();
+		ISR_CALL(hsk_isr14.NMIVDDP, ISR_STATS_14_NMIVDDP);
 	}
+#endif
+#ifdef ISR14_NMIECC
 	if (NMISR & (1 << BIT_NMIECC)) {
 		NMISR &= ~(1 << BIT_NMIECC);
-		hsk_isr14.NMIECC();
+		ISR_CALL(hsk_isr14.NMIECC, ISR_STATS_14_NMIECC);
 	}
+#endif
 	SFR_PAGE(_su0, RST2);
+#endif
 
 	rmap ? (SET_RMAP()) : (RESET_RMAP());
 }
 
+#ifdef ISR_STATS
+void hsk_isr_stats_get(const ubyte source,
+                       struct hsk_isr_stats xdata * const stats) {
+	if (source >= ISR_STATS_COUNT) {
+		return;
+	}
+	/* Copy until the callback did not interrupt copying, this way NMI
+	 * sources do not have to be masked. */
+	do {
+		stats->count = timing[source].count;
+		stats->min = timing[source].min;
+		stats->max = timing[source].max;
+		stats->total = timing[source].total;
+	} while (stats->count != timing[source].count);
+}
+
+void hsk_isr_stats_reset(void) {
+	bool ea = EA;
+	ubyte i;
+
+	EA = 0;
+	for (i = 0; i < ISR_STATS_COUNT; i++) {
+		/* Clear until no callback interrupted clearing, the count is
+		 * cleared first, so an NMI source updating the entry in
+		 * between leaves a count to detect it. */
+		do {
+			timing[i].count = 0;
+			timing[i].min = 0;
+			timing[i].max = 0;
+			timing[i].total = 0;
+		} while (timing[i].count);
+	}
+	EA = ea;
+}
+#endif /* ISR_STATS */
@@ -354,6 +354,256 @@ struct hsk_isr14_callback {
  */
 extern volatile struct hsk_isr14_callback pdata hsk_isr14;
 
+#ifdef ISR_STATS
+
+/**
+ * Interrupt source ID of hsk_isr5.TF2.
+ */
+#define ISR_STATS_5_TF2                0
+
+/**
+ * Interrupt source ID of hsk_isr5.EXF2.
+ */
+#define ISR_STATS_5_EXF2               1
+
+/**
+ * Interrupt source ID of hsk_isr5.CCTOVF.
+ */
+#define ISR_STATS_5_CCTOVF             2
+
+/**
+ * Interrupt source ID of hsk_isr5.NDOV.
+ */
+#define ISR_STATS_5_NDOV               3
+
+/**
+ * Interrupt source ID of hsk_isr5.EOFSYN.
+ */
+#define ISR_STATS_5_EOFSYN             4
+
+/**
+ * Interrupt source ID of hsk_isr5.ERRSYN.
+ */
+#define ISR_STATS_5_ERRSYN             5
+
+/**
+ * Interrupt source ID of hsk_isr5.CANSRC0.
+ */
+#define ISR_STATS_5_CANSRC0            6
+
+/**
+ * Interrupt source ID of hsk_isr6.CANSRC1.
+ */
+#define ISR_STATS_6_CANSRC1            7
+
+/**
+ * Interrupt source ID of hsk_isr6.CANSRC2.
+ */
+#define ISR_STATS_6_CANSRC2            8
+
+/**
+ * Interrupt source ID of hsk_isr6.ADCSR0.
+ */
+#define ISR_STATS_6_ADCSR0             9
+
+/**
+ * Interrupt source ID of hsk_isr6.ADCSR1.
+ */
+#define ISR_STATS_6_ADCSR1             10
+
+/**
+ * Interrupt source ID of hsk_isr8.EXINT2.
+ */
+#define ISR_STATS_8_EXINT2             11
+
+/**
+ * Interrupt source ID of hsk_isr8.NDOV.
+ */
+#define ISR_STATS_8_NDOV               12
+
+/**
+ * Interrupt source ID of hsk_isr8.RI.
+ */
+#define ISR_STATS_8_RI                 13
+
+/**
+ * Interrupt source ID of hsk_isr8.TI.
+ */
+#define ISR_STATS_8_TI                 14
+
+/**
+ * Interrupt source ID of hsk_isr8.TF2.
+ */
+#define ISR_STATS_8_TF2                15
+
+/**
+ * Interrupt source ID of hsk_isr8.EXF2.
+ */
+#define ISR_STATS_8_EXF2               16
+
+/**
+ * Interrupt source ID of hsk_isr8.EOC.
+ */
+#define ISR_STATS_8_EOC                17
+
+/**
+ * Interrupt source ID of hsk_isr8.IRDY.
+ */
+#define ISR_STATS_8_IRDY               18
+
+/**
+ * Interrupt source ID of hsk_isr8.IERR.
+ */
+#define ISR_STATS_8_IERR               19
+
+/**
+ * Interrupt source ID of hsk_isr9.EXINT3.
+ */
+#define ISR_STATS_9_EXINT3             20
+
+/**
+ * Interrupt source ID of hsk_isr9.EXINT4.
+ */
+#define ISR_STATS_9_EXINT4             21
+
+/**
+ * Interrupt source ID of hsk_isr9.EXINT5.
+ */
+#define ISR_STATS_9_EXINT5             22
+
+/**
+ * Interrupt source ID of hsk_isr9.EXINT6.
+ */
+#define ISR_STATS_9_EXINT6             23
+
+/**
+ * Interrupt source ID of hsk_isr9.CANSRC3.
+ */
+#define ISR_STATS_9_CANSRC3            24
+
+/**
+ * Interrupt source ID of hsk_isr14.NMIWDT.
+ */
+#define ISR_STATS_14_NMIWDT            25
+
+/**
+ * Interrupt source ID of hsk_isr14.NMIPLL.
+ */
+#define ISR_STATS_14_NMIPLL            26
+
+/**
+ * Interrupt source ID of hsk_isr14.NMIFLASH.
+ */
+#define ISR_STATS_14_NMIFLASH          27
+
+/**
+ * Interrupt source ID of hsk_isr14.NMIVDDP.
+ */
+#define ISR_STATS_14_NMIVDDP           28
+
+/**
+ * Interrupt source ID of hsk_isr14.NMIECC.
+ */
+#define ISR_STATS_14_NMIECC            29
+
+/**
+ * The number of interrupt sources.
+ */
+#define ISR_STATS_COUNT                30
+
+#ifndef ISR_STATS_TIMER
+/**
+ * Takes the time stamp used to time callbacks.
+ *
+ * Defaults to the count of Timer 1, which must be set up as a free running
+ * 16 bit timer, e.g.:
+ * \code
+ * TMOD = TMOD & 0x0f | 0x10;
+ * TR1 = 1;
+ * \endcode
+ * This way time stamps are in units of 2 CCLK cycles.
+ *
+ * The high byte is read again after the low byte, to catch an overflow
+ * of the low byte in between.
+ *
+ * A different time base can be selected by defining ISR_STATS_TIMER()
+ * at build time. It must not depend on SFR pages or RMAP and has to
+ * wrap around at 16 bits.
+ *
+ * @param time
+ *	The uword lvalue to store the time stamp in
+ */
+#define ISR_STATS_TIMER(time) { \
+	do { \
+		time = (uword)TH1 << 8; \
+		time |= TL1; \
+	} while ((ubyte)(time >> 8) != TH1); \
+}
+#endif /* ISR_STATS_TIMER */
+
+/**
+ * Execution time statistics of an interrupt source callback.
+ *
+ * Times are in \ref ISR_STATS_TIMER units.
+ */
+struct hsk_isr_stats {
+	/**
+	 * The shortest execution time.
+	 */
+	uword min;
+
+	/**
+	 * The longest execution time.
+	 */
+	uword max;
+
+	/**
+	 * The number of calls.
+	 */
+	ulong count;
+
+	/**
+	 * The sum of all execution times.
+	 *
+	 * Divide by count to get the average execution time.
+	 */
+	ulong total;
+};
+
+/**
+ * Returns the callback execution time statistics of an interrupt source.
+ *
+ * The time is measured from before calling the callback function to
+ * its return, i.e. it includes the time of interrupts that interrupted
+ * the callback, e.g. NMIs.
+ *
+ * Only available if \c ISR_STATS is defined at build time, e.g. by adding
+ * the following line to the \c Makefile.local:
+ * \code
+ * CFLAGS+=	-DISR_STATS
+ * \endcode
+ *
+ * @param source
+ *	The interrupt source, one of ISR_STATS_*
+ * @param stats
+ *	The struct to store the statistics in, left unchanged for invalid
+ *	sources
+ */
+void hsk_isr_stats_get(const ubyte source,
+                       struct hsk_isr_stats xdata * const stats);
+
+/**
+ * Resets the statistics of all interrupt sources.
+ *
+ * NMI sources are not masked, an entry is cleared again if an NMI
+ * updated it during the reset.
+ *
+ * Only available if \c ISR_STATS is defined at build time.
+ */
+void hsk_isr_stats_reset(void);
+
+#endif /* ISR_STATS */
+
 /*
  * Restore the usual meaning of \c code.
  */
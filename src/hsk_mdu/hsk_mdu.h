@@ -0,0 +1,299 @@
+/** \file
+ * HSK Multiply/Divide Unit headers
+ *
+ * This file contains macro definitions to perform 16 and 32 bit integer
+ * arithmetic with the XC878 Multiply/Divide Unit (MDU).
+ *
+ * SDCC implements ulong multiplication, division and variable shifts in
+ * software routines that take hundreds of cycles. The MDU completes any
+ * of its operations within 32 CCLK cycles.
+ *
+ * The MDU is only used if \c MDU_ENABLE is defined at build time, e.g.
+ * by adding the following line to the \c Makefile.local:
+ * \code
+ * CFLAGS+=	-DMDU_ENABLE
+ * \endcode
+ * Otherwise all macros fall back to plain C arithmetic, so libraries can
+ * use them unconditionally.
+ *
+ * All macros take an lvalue to store the result in as the first argument.
+ * The operands are evaluated exactly once, before the MDU is accessed.
+ *
+ * The macros are implemented inline, so they can be used from regular code
+ * as well as from ISR callback functions using register bank 1.
+ * A calculation cannot be interrupted by another one, because interrupts
+ * are blocked for the duration of the MDU access. The MDU must not be
+ * used in NMI callbacks.
+ *
+ * @author kami
+ *
+ * \section mdu_registers MDU Registers
+ *
+ * All MDU registers are in the mapped register area, the macros set and
+ * reset RMAP. They can be used with RMAP 0 and any SFR pages, and always
+ * terminate with RMAP 0.
+ */
+
+#ifndef _HSK_MDU_H_
+#define _HSK_MDU_H_
+
+/**
+ * MDU_MDUCON Result Register Select bit.
+ */
+#define MDU_BIT_RSEL          5
+
+/**
+ * MDU_MDUCON Start Calculation bit.
+ */
+#define MDU_BIT_START         4
+
+/**
+ * MDU_MDUCON Operation Code bits.
+ */
+#define MDU_BIT_OPCODE        0
+
+/**
+ * MDU_MD4 Shift Direction bit.
+ */
+#define MDU_BIT_SLR           5
+
+/**
+ * Operation code for unsigned 16 x 16 bit multiplication.
+ */
+#define MDU_OP_MUL            0x0
+
+/**
+ * Operation code for unsigned 16 / 16 bit division.
+ */
+#define MDU_OP_DIV16          0x1
+
+/**
+ * Operation code for unsigned 32 / 16 bit division.
+ */
+#define MDU_OP_DIV32          0x2
+
+/**
+ * Operation code for a logical 32 bit shift.
+ */
+#define MDU_OP_SHIFT          0x3
+
+/**
+ * Operation code for 32 bit normalization.
+ */
+#define MDU_OP_NORM           0x8
+
+#ifdef MDU_ENABLE
+
+/**
+ * Start an MDU operation and wait for its completion.
+ *
+ * Result registers are selected for reading afterwards.
+ *
+ * @warning
+ *	Expects RMAP 1 and interrupts blocked
+ * @param op
+ *	The operation code, one of MDU_OP_*
+ * @private
+ */
+#define MDU_RUN(op) { \
+	MDU_MDUCON = (1 << MDU_BIT_RSEL) | (1 << MDU_BIT_START) \
+	             | ((op) << MDU_BIT_OPCODE); \
+	while (MDU_BSY); \
+}
+
+/**
+ * Multiply two 16 bit values, resulting in a 32 bit value.
+ *
+ * @param result
+ *	The ulong lvalue to store the product in
+ * @param a
+ *	The 16 bit multiplicand
+ * @param b
+ *	The 16 bit multiplier
+ */
+#define MDU_MUL(result, a, b) { \
+	uword mdu_a = (a); \
+	uword mdu_b = (b); \
+	ulong mdu_result; \
+	bool mdu_ea = EA; \
+	EA = 0; \
+	SET_RMAP(); \
+	MDU_MD01 = mdu_a; \
+	MDU_MD45 = mdu_b; \
+	MDU_RUN(MDU_OP_MUL); \
+	mdu_result = MDU_MR01 | ((ulong)MDU_MR23 << 16); \
+	RESET_RMAP(); \
+	EA = mdu_ea; \
+	(result) = mdu_result; \
+}
+
+/**
+ * Divide a 16 bit value by another 16 bit value.
+ *
+ * @param result
+ *	The uword lvalue to store the quotient in
+ * @param a
+ *	The 16 bit dividend
+ * @param b
+ *	The 16 bit divisor, must not be 0
+ */
+#define MDU_DIV16(result, a, b) { \
+	uword mdu_a = (a); \
+	uword mdu_b = (b); \
+	uword mdu_result; \
+	bool mdu_ea = EA; \
+	EA = 0; \
+	SET_RMAP(); \
+	MDU_MD01 = mdu_a; \
+	MDU_MD45 = mdu_b; \
+	MDU_RUN(MDU_OP_DIV16); \
+	mdu_result = MDU_MR01; \
+	RESET_RMAP(); \
+	EA = mdu_ea; \
+	(result) = mdu_result; \
+}
+
+/**
+ * Divide a 32 bit value by a 16 bit value.
+ *
+ * @param result
+ *	The ulong lvalue to store the quotient in
+ * @param a
+ *	The 32 bit dividend
+ * @param b
+ *	The 16 bit divisor, must not be 0
+ */
+#define MDU_DIV32(result, a, b) { \
+	ulong mdu_a = (a); \
+	uword mdu_b = (b); \
+	ulong mdu_result; \
+	bool mdu_ea = EA; \
+	EA = 0; \
+	SET_RMAP(); \
+	MDU_MD01 = mdu_a; \
+	MDU_MD23 = mdu_a >> 16; \
+	MDU_MD45 = mdu_b; \
+	MDU_RUN(MDU_OP_DIV32); \
+	mdu_result = MDU_MR01 | ((ulong)MDU_MR23 << 16); \
+	RESET_RMAP(); \
+	EA = mdu_ea; \
+	(result) = mdu_result; \
+}
+
+/**
+ * Shift a 32 bit value.
+ *
+ * @param result
+ *	The ulong lvalue to store the shifted value in
+ * @param a
+ *	The 32 bit value to shift
+ * @param shift
+ *	The number of bits to shift, 0 to 31
+ * @param right
+ *	Shift right if 1, left if 0
+ * @private
+ */
+#define MDU_SHIFT(result, a, shift, right) { \
+	ulong mdu_a = (a); \
+	ubyte mdu_shift = (shift); \
+	ulong mdu_result; \
+	bool mdu_ea = EA; \
+	EA = 0; \
+	SET_RMAP(); \
+	MDU_MD01 = mdu_a; \
+	MDU_MD23 = mdu_a >> 16; \
+	MDU_MD4 = mdu_shift | ((right) << MDU_BIT_SLR); \
+	MDU_RUN(MDU_OP_SHIFT); \
+	mdu_result = MDU_MR01 | ((ulong)MDU_MR23 << 16); \
+	RESET_RMAP(); \
+	EA = mdu_ea; \
+	(result) = mdu_result; \
+}
+
+/**
+ * Normalize a 32 bit value.
+ *
+ * I.e. shift it left until the most significant bit is set.
+ *
+ * @param result
+ *	The ulong lvalue to store the normalized value in
+ * @param shift
+ *	The ubyte lvalue to store the number of performed shifts in
+ * @param a
+ *	The 32 bit value to normalize, must not be 0
+ */
+#define MDU_NORM(result, shift, a) { \
+	ulong mdu_a = (a); \
+	ulong mdu_result; \
+	ubyte mdu_shift; \
+	bool mdu_ea = EA; \
+	EA = 0; \
+	SET_RMAP(); \
+	MDU_MD01 = mdu_a; \
+	MDU_MD23 = mdu_a >> 16; \
+	MDU_RUN(MDU_OP_NORM); \
+	mdu_result = MDU_MR01 | ((ulong)MDU_MR23 << 16); \
+	mdu_shift = MDU_MR4 & ((1 << MDU_BIT_SLR) - 1); \
+	RESET_RMAP(); \
+	EA = mdu_ea; \
+	(result) = mdu_result; \
+	(shift) = mdu_shift; \
+}
+
+#else /* MDU_ENABLE */
+
+#define MDU_MUL(result, a, b) { \
+	(result) = (ulong)(uword)(a) * (uword)(b); \
+}
+
+#define MDU_DIV16(result, a, b) { \
+	(result) = (uword)(a) / (uword)(b); \
+}
+
+#define MDU_DIV32(result, a, b) { \
+	(result) = (ulong)(a) / (uword)(b); \
+}
+
+#define MDU_SHIFT(result, a, shift, right) { \
+	(result) = (right) ? (ulong)(a) >> (shift) : (ulong)(a) << (shift); \
+}
+
+#define MDU_NORM(result, shift, a) { \
+	ulong mdu_a = (a); \
+	ubyte mdu_shift; \
+	for (mdu_shift = 0; !(mdu_a & (1ul << 31)); mdu_shift++) { \
+		mdu_a <<= 1; \
+	} \
+	(result) = mdu_a; \
+	(shift) = mdu_shift; \
+}
+
+#endif /* MDU_ENABLE */
+
+/**
+ * Shift a 32 bit value left.
+ *
+ * @param result
+ *	The ulong lvalue to store the shifted value in
+ * @param a
+ *	The 32 bit value to shift
+ * @param shift
+ *	The number of bits to shift, 0 to 31
+ */
+#define MDU_SHL(result, a, shift) \
+	MDU_SHIFT(result, a, shift, 0)
+
+/**
+ * Shift a 32 bit value right.
+ *
+ * @param result
+ *	The ulong lvalue to store the shifted value in
+ * @param a
+ *	The 32 bit value to shift
+ * @param shift
+ *	The number of bits to shift, 0 to 31
+ */
+#define MDU_SHR(result, a, shift) \
+	MDU_SHIFT(result, a, shift, 1)
+
+#endif /* _HSK_MDU_H_ */
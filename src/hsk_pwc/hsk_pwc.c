@@ -14,22 +14,177 @@
 #include <string.h> /* memset() */
 
 #include "../hsk_isr/hsk_isr.h"
+#include "../hsk_mdu/hsk_mdu.h"
 
 /**
  * The number of available PWC channels.
  */
 #define PWC_CHANNELS         4
 
+#ifndef PWC_BUF_SIZE
 /**
- * The size of a PWC ring buffer.
+ * The default size of a PWC ring buffer.
  *
- * This must not be greater than 32 or the calculation of values returned
- * by hsk_pwc_channel_getValue() might overflow.
+ * Every channel has its own ring buffer in xdata memory, the size of
+ * each channel can be set at build time with PWC_CC0_BUF_SIZE to
+ * PWC_CC3_BUF_SIZE, which default to this value. Slow signals benefit
+ * from long buffers, channels that are not used or only need the latest
+ * value can be set to 0 or 1 to conserve memory. E.g. add the following
+ * line to the \c Makefile.local:
+ * \code
+ * CFLAGS+=	-DPWC_CC0_BUF_SIZE=64 -DPWC_CC1_BUF_SIZE=1 -DPWC_CC2_BUF_SIZE=0
+ * \endcode
  *
- * The value 8 should be a sensible compromise between an interest to get
- * averages from a sufficient number of values and memory use.
+ * The averageOver argument of hsk_pwc_channel_open() is limited to the
+ * buffer size of the channel. A channel without a buffer can still be
+ * opened, e.g. to use it for compare events, but it never provides a
+ * valid value.
+ *
+ * All sizes must be 0 or a power of 2 and must not be greater than 64.
+ * The sum of 64 values fits into 22 bits, hsk_pwc_channel_getValue()
+ * divides it by the number of values before applying the prescaler, so
+ * the averages do not overflow. The frequency calculations limit the
+ * size, because \f$ 48 * 10^6 * 64 \f$ must fit into 32 bits.
+ */
+#define PWC_BUF_SIZE         8
+#endif
+
+#ifndef PWC_CC0_BUF_SIZE
+/**
+ * The ring buffer size of channel PWC_CC0.
+ */
+#define PWC_CC0_BUF_SIZE     PWC_BUF_SIZE
+#endif
+
+#if PWC_CC0_BUF_SIZE < 0 || PWC_CC0_BUF_SIZE > 64 || PWC_CC0_BUF_SIZE & (PWC_CC0_BUF_SIZE - 1)
+#error PWC_CC0_BUF_SIZE must be 0 or a power of 2 between 1 and 64
+#endif
+
+#ifndef PWC_CC1_BUF_SIZE
+/**
+ * The ring buffer size of channel PWC_CC1.
+ */
+#define PWC_CC1_BUF_SIZE     PWC_BUF_SIZE
+#endif
+
+#if PWC_CC1_BUF_SIZE < 0 || PWC_CC1_BUF_SIZE > 64 || PWC_CC1_BUF_SIZE & (PWC_CC1_BUF_SIZE - 1)
+#error PWC_CC1_BUF_SIZE must be 0 or a power of 2 between 1 and 64
+#endif
+
+#ifndef PWC_CC2_BUF_SIZE
+/**
+ * The ring buffer size of channel PWC_CC2.
+ */
+#define PWC_CC2_BUF_SIZE     PWC_BUF_SIZE
+#endif
+
+#if PWC_CC2_BUF_SIZE < 0 || PWC_CC2_BUF_SIZE > 64 || PWC_CC2_BUF_SIZE & (PWC_CC2_BUF_SIZE - 1)
+#error PWC_CC2_BUF_SIZE must be 0 or a power of 2 between 1 and 64
+#endif
+
+#ifndef PWC_CC3_BUF_SIZE
+/**
+ * The ring buffer size of channel PWC_CC3.
+ */
+#define PWC_CC3_BUF_SIZE     PWC_BUF_SIZE
+#endif
+
+#if PWC_CC3_BUF_SIZE < 0 || PWC_CC3_BUF_SIZE > 64 || PWC_CC3_BUF_SIZE & (PWC_CC3_BUF_SIZE - 1)
+#error PWC_CC3_BUF_SIZE must be 0 or a power of 2 between 1 and 64
+#endif
+
+#if PWC_CC0_BUF_SIZE + PWC_CC1_BUF_SIZE + PWC_CC2_BUF_SIZE + PWC_CC3_BUF_SIZE < 1
+#error At least one PWC channel needs a ring buffer
+#endif
+
+#ifndef PWC_SORT_SIZE
+/**
+ * The maximum number of values to average over in the sorting filter
+ * modes.
+ *
+ * Every channel has a sorted buffer of this size in xdata memory, or of
+ * its ring buffer size if that is smaller. The capture interrupt needs
+ * time linear to the number of values to keep the sorted buffer up to
+ * date.
+ *
+ * This must be a power of 2 and must not be greater than 64.
+ */
+#define PWC_SORT_SIZE        8
+#endif
+
+#if PWC_SORT_SIZE < 1 || PWC_SORT_SIZE > 64 || PWC_SORT_SIZE & (PWC_SORT_SIZE - 1)
+#error PWC_SORT_SIZE must be a power of 2 between 1 and 64
+#endif
+
+/**
+ * Returns the ring buffer size of a channel.
+ *
+ * Evaluates to a constant for constant channels.
+ *
+ * @param chan
+ *	The channel to return the buffer size of
+ * @private
+ */
+#define PWC_BUF_LEN(chan) \
+	((chan) == 0 ? PWC_CC0_BUF_SIZE : \
+	 (chan) == 1 ? PWC_CC1_BUF_SIZE : \
+	 (chan) == 2 ? PWC_CC2_BUF_SIZE : PWC_CC3_BUF_SIZE)
+
+/**
+ * Returns the sorted buffer size of a channel.
+ *
+ * @param chan
+ *	The channel to return the sorted buffer size of
+ * @private
+ */
+#define PWC_SORT_LEN(chan) \
+	(PWC_BUF_LEN(chan) < PWC_SORT_SIZE ? PWC_BUF_LEN(chan) : PWC_SORT_SIZE)
+
+/**
+ * Returns the sum of the buffer sizes of the channels in front of a
+ * channel.
+ *
+ * @param len
+ *	The macro returning the buffer size of a channel
+ * @param chan
+ *	The channel to return the buffer offset of
+ * @private
+ */
+#define PWC_OFFSET(len, chan) \
+	(((chan) > 0 ? len(0) : 0) + ((chan) > 1 ? len(1) : 0) \
+	 + ((chan) > 2 ? len(2) : 0) + ((chan) > 3 ? len(3) : 0))
+
+/** \var buffers
+ * The ring buffers of the PWC channels, one after another.
+ */
+static volatile uword xdata buffers[PWC_OFFSET(PWC_BUF_LEN, PWC_CHANNELS)];
+
+/** \var sortedBuffers
+ * The sorted copies of the ring buffers, used by the sorting filter
+ * modes.
  */
-#define CHAN_BUF_SIZE        8
+static volatile uword xdata sortedBuffers[PWC_OFFSET(PWC_SORT_LEN, PWC_CHANNELS)];
+
+/**
+ * Returns the ring buffer of a channel.
+ *
+ * For constant channels the buffer address is a constant, so the
+ * capture ISRs access their buffers directly.
+ *
+ * @param chan
+ *	The channel to return the ring buffer of
+ * @private
+ */
+#define PWC_BUF(chan)        (buffers + PWC_OFFSET(PWC_BUF_LEN, chan))
+
+/**
+ * Returns the sorted buffer of a channel.
+ *
+ * @param chan
+ *	The channel to return the sorted buffer of
+ * @private
+ */
+#define PWC_SORTED(chan)     (sortedBuffers + PWC_OFFSET(PWC_SORT_LEN, chan))
 
 /**
  * The prescaling factor.
@@ -50,21 +205,24 @@ static volatile struct {
 	 */
 	ulong sum;
 
-	/**
-	 * A ring buffer of PWC values.
-	 */
-	uword buffer[CHAN_BUF_SIZE];
-
 	/**
 	 * The last captured value.
 	 */
 	uword lastCapture;
 
 	/**
-	 * The number of pulses to average over.
+	 * The number of pulses to average over, always a power of 2.
+	 *
+	 * This is derived from averageOverConf and the filter mode.
 	 */
 	ubyte averageOver;
 
+	/**
+	 * The number of pulses to average over, as set up by
+	 * hsk_pwc_channel_open().
+	 */
+	ubyte averageOverConf;
+
 	/**
 	 * The current ring position.
 	 */
@@ -73,11 +231,16 @@ static volatile struct {
 	/**
 	 * The overflow count during the last capture.
 	 *
-	 * This is used by hsk_pwc_channel_getSum() to detect whether the capturing
-	 * time window was left.
+	 * This is used to detect whether the capturing time window was left.
 	 */
 	ubyte overflow;
 
+	/**
+	 * The number of window times without a capture event before the
+	 * channel is considered stalled.
+	 */
+	ubyte timeout;
+
 	/**
 	 * This is an invalidation counter.
 	 *
@@ -94,252 +257,229 @@ static volatile struct {
 	 * a low pulse.
 	 */
 	ubyte state;
-} pdata channels[PWC_CHANNELS];
-
-#pragma save
-#ifdef SDCC
-#pragma nooverlay
-#endif
-/**
- * This is the common implementation of the Capture ISRs.
- *
- * @param channel
- *	The channel that was captured.
- * @param capture
- *	The value that was captured.
- * @private
- */
-void hsk_pwc_isr_ccn(const hsk_pwc_channel channel, uword capture) using 1 {
-	#define channel    channels[channel]
-	/* Get the new value and store the current capture value for next
-	 * time. */
-	capture -= channel.lastCapture;
-	channel.lastCapture += capture;
-	/* Update the sum and buffer. */
-	channel.sum -= channel.buffer[channel.pos];
-	channel.buffer[channel.pos++] = capture;
-	channel.pos %= channel.averageOver;
-	channel.sum += capture;
-	/* Update the overflow count.. */
-	channel.overflow = overflows;
-	/* Update the invalidation count. */
-	if (channel.invalid) {
-		channel.invalid--;
-	}
-	#undef channel
-}
 
-/**
- * The ISR for Capture events on channel PWC_CC0_P30.
- *
- * @private
- */
-void hsk_pwc_isr_cc0_p30(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[0].state = (P3_DATA >> 0) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_2, SST1);
-	hsk_pwc_isr_ccn(0, T2CCU_CC0LH);
-	SFR_PAGE(_t2_2, RST1);
-}
-
-/**
- * The ISR for Capture events on channel PWC_CC0_P40.
- *
- * @private
- */
-void hsk_pwc_isr_cc0_p40(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[0].state = (P4_DATA >> 0) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_2, SST1);
-	hsk_pwc_isr_ccn(0, T2CCU_CC0LH);
-	SFR_PAGE(_t2_2, RST1);
-}
-
-/**
- * The ISR for Capture events on channel PWC_CC0_P55.
- *
- * @private
- */
-void hsk_pwc_isr_cc0_p55(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[0].state = (P5_DATA >> 5) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_2, SST1);
-	hsk_pwc_isr_ccn(0, T2CCU_CC0LH);
-	SFR_PAGE(_t2_2, RST1);
-}
-
-/**
- * The ISR for Capture events on channel PWC_CC1_P32.
- *
- * @private
- */
-void hsk_pwc_isr_cc1_p32(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[1].state = (P3_DATA >> 2) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_2, SST1);
-	hsk_pwc_isr_ccn(1, T2CCU_CC1LH);
-	SFR_PAGE(_t2_2, RST1);
-}
+	/**
+	 * The filter mode, one of PWC_FILTER_*.
+	 */
+	ubyte filter;
 
-/**
- * The ISR for Capture events on channel PWC_CC1_P41.
- *
- * @private
- */
-void hsk_pwc_isr_cc1_p41(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[1].state = (P4_DATA >> 1) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_2, SST1);
-	hsk_pwc_isr_ccn(1, T2CCU_CC1LH);
-	SFR_PAGE(_t2_2, RST1);
-}
+	/**
+	 * The edge mode, one of PWC_EDGE_*.
+	 */
+	ubyte edge;
+} pdata channels[PWC_CHANNELS];
 
 /**
- * The ISR for Capture events on channel PWC_CC1_P56.
+ * Adds a value to the ring buffer of a channel.
  *
+ * @param chan
+ *	The channel to add the value to
+ * @param value
+ *	The value to add
  * @private
  */
-void hsk_pwc_isr_cc1_p56(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[1].state = (P5_DATA >> 6) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_2, SST1);
-	hsk_pwc_isr_ccn(1, T2CCU_CC1LH);
-	SFR_PAGE(_t2_2, RST1);
+#define PWC_PUSH(chan, value) { \
+	uword pwc_value = (value); \
+	uword pwc_old; \
+	ubyte pwc_i, pwc_j; \
+	/* Update the sorted buffer. */ \
+	if (channels[chan].filter) { \
+		/* Find the value that drops out of the buffer. */ \
+		pwc_old = PWC_BUF(chan)[channels[chan].pos]; \
+		for (pwc_i = 0; pwc_i < channels[chan].averageOver && PWC_SORTED(chan)[pwc_i] != pwc_old; pwc_i++); \
+		/* Rebuild the sorted buffer if it is inconsistent. */ \
+		if (pwc_i == channels[chan].averageOver) { \
+			for (pwc_i = 0; pwc_i < channels[chan].averageOver; pwc_i++) { \
+				for (pwc_j = pwc_i; pwc_j && PWC_SORTED(chan)[pwc_j - 1] > PWC_BUF(chan)[pwc_i]; pwc_j--) { \
+					PWC_SORTED(chan)[pwc_j] = PWC_SORTED(chan)[pwc_j - 1]; \
+				} \
+				PWC_SORTED(chan)[pwc_j] = PWC_BUF(chan)[pwc_i]; \
+			} \
+			for (pwc_i = 0; pwc_i < channels[chan].averageOver - 1 && PWC_SORTED(chan)[pwc_i] != pwc_old; pwc_i++); \
+		} \
+		/* Shift values into its place until the new value fits in. */ \
+		for (; pwc_i < channels[chan].averageOver - 1 && PWC_SORTED(chan)[pwc_i + 1] < pwc_value; pwc_i++) { \
+			PWC_SORTED(chan)[pwc_i] = PWC_SORTED(chan)[pwc_i + 1]; \
+		} \
+		for (; pwc_i && PWC_SORTED(chan)[pwc_i - 1] > pwc_value; pwc_i--) { \
+			PWC_SORTED(chan)[pwc_i] = PWC_SORTED(chan)[pwc_i - 1]; \
+		} \
+		PWC_SORTED(chan)[pwc_i] = pwc_value; \
+	} \
+	/* Update the sum and buffer. */ \
+	channels[chan].sum -= PWC_BUF(chan)[channels[chan].pos]; \
+	PWC_BUF(chan)[channels[chan].pos++] = pwc_value; \
+	channels[chan].pos &= channels[chan].averageOver - 1; \
+	channels[chan].sum += pwc_value; \
 }
 
 /**
- * The ISR for Capture events on channel PWC_CC2_P33.
+ * This is the common implementation of the Capture ISRs and soft capture
+ * events.
  *
- * @private
- */
-void hsk_pwc_isr_cc2_p33(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[2].state = (P3_DATA >> 3) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_2, SST1);
-	hsk_pwc_isr_ccn(2, T2CCU_CC2LH);
-	SFR_PAGE(_t2_2, RST1);
-}
-
-/**
- * The ISR for Capture events on channel PWC_CC2_P44.
+ * The Capture ISRs pass a constant channel, which allows the compiler to
+ * address the channel data directly.
  *
- * @private
- */
-void hsk_pwc_isr_cc2_p44(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[2].state = (P4_DATA >> 4) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_2, SST1);
-	hsk_pwc_isr_ccn(2, T2CCU_CC2LH);
-	SFR_PAGE(_t2_2, RST1);
-}
-
-/**
- * The ISR for Capture events on channel PWC_CC2_P52.
+ * Intervals longer than the window time cannot be represented. Dropping
+ * them would break the alternation of high and low pulses in the buffer,
+ * so the channel is invalidated instead.
  *
- * @private
- */
-void hsk_pwc_isr_cc2_p52(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[2].state = (P5_DATA >> 2) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_2, SST1);
-	hsk_pwc_isr_ccn(2, T2CCU_CC2LH);
-	SFR_PAGE(_t2_2, RST1);
-}
-
-
-/**
- * The ISR for Capture events on channel PWC_CC3_P34.
+ * Channels without a ring buffer are ignored.
  *
+ * @param chan
+ *	The channel that was captured
+ * @param capture
+ *	The value that was captured
+ * @param now
+ *	The CCT value when the capture was serviced
  * @private
  */
-void hsk_pwc_isr_cc3_p34(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[3].state = (P3_DATA >> 4) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_3, SST1);
-	hsk_pwc_isr_ccn(3, T2CCU_CC3LH);
-	SFR_PAGE(_t2_3, RST1);
+#define PWC_CCN(chan, capture, now) { \
+	if (channels[chan].averageOver) { \
+		uword pwc_capture = (capture); \
+		ubyte pwc_age = overflows - channels[chan].overflow; \
+		/* A capture shortly before an overflow may be serviced after the \
+		 * overflow interrupt, i.e. with an off by one overflow count. */ \
+		if (pwc_age && (now) < pwc_capture) { \
+			pwc_age--; \
+		} \
+		/* Get the new value and store the current capture value for next \
+		 * time. */ \
+		pwc_capture -= channels[chan].lastCapture; \
+		channels[chan].lastCapture += pwc_capture; \
+		/* Only use the value if the window time has not been left. */ \
+		if (!pwc_age || (pwc_age == 1 \
+		                 && channels[chan].lastCapture < pwc_capture)) { \
+			PWC_PUSH(chan, pwc_capture); \
+			/* Update the invalidation count. */ \
+			if (channels[chan].invalid) { \
+				channels[chan].invalid--; \
+			} \
+		} else { \
+			/* Start over with the next interval. */ \
+			channels[chan].invalid = channels[chan].averageOver; \
+		} \
+		/* Update the overflow count. */ \
+		channels[chan].overflow = overflows; \
+	} \
 }
 
 /**
- * The ISR for Capture events on channel PWC_CC3_P45.
+ * Creates the ISR for Capture events on a channel/port combination.
  *
- * @private
- */
-void hsk_pwc_isr_cc3_p45(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[3].state = (P4_DATA >> 5) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_3, SST1);
-	hsk_pwc_isr_ccn(3, T2CCU_CC3LH);
-	SFR_PAGE(_t2_3, RST1);
-}
-
-/**
- * The ISR for Capture events on channel PWC_CC3_P57.
+ * The ISR records the input pin state and passes the capture register
+ * and the current CCT value to PWC_CCN().
  *
+ * @param chan
+ *	The channel number
+ * @param port
+ *	The port number of the input pin
+ * @param pin
+ *	The pin number of the input pin
+ * @param page
+ *	The T2CCU SFR page holding the capture register of the channel
  * @private
  */
-void hsk_pwc_isr_cc3_p57(void) using 1 {
-	SFR_PAGE(_pp0, SST1);
-	channels[3].state = (P5_DATA >> 7) & 1;
-	SFR_PAGE(_pp0, RST1);
-	SFR_PAGE(_t2_3, SST1);
-	hsk_pwc_isr_ccn(3, T2CCU_CC3LH);
-	SFR_PAGE(_t2_3, RST1);
-}
+#define PWC_ISR_FACTORY(chan, port, pin, page) \
+	/**
+	 * The ISR for Capture events on a channel/port combination.
+	 *
+	 * @private
+	 */\
+	void hsk_pwc_isr_cc##chan##_p##port##pin(void) using 1 { \
+		uword now; \
+		SFR_PAGE(_pp0, SST1); \
+		channels[chan].state = (P##port##_DATA >> pin) & 1; \
+		SFR_PAGE(_pp0, RST1); \
+		SFR_PAGE(_t2_1, SST1); \
+		now = T2CCU_CCTLH; \
+		SFR_PAGE(_t2_1, RST1); \
+		SFR_PAGE(page, SST1); \
+		PWC_CCN(chan, T2CCU_CC##chan##LH, now); \
+		SFR_PAGE(page, RST1); \
+	}
 
+#pragma save
+#ifdef SDCC
+#pragma nooverlay
+#endif
+PWC_ISR_FACTORY(0, 3, 0, _t2_2)
+PWC_ISR_FACTORY(0, 4, 0, _t2_2)
+PWC_ISR_FACTORY(0, 5, 5, _t2_2)
+PWC_ISR_FACTORY(1, 3, 2, _t2_2)
+PWC_ISR_FACTORY(1, 4, 1, _t2_2)
+PWC_ISR_FACTORY(1, 5, 6, _t2_2)
+PWC_ISR_FACTORY(2, 3, 3, _t2_2)
+PWC_ISR_FACTORY(2, 4, 4, _t2_2)
+PWC_ISR_FACTORY(2, 5, 2, _t2_2)
+PWC_ISR_FACTORY(3, 3, 4, _t2_3)
+PWC_ISR_FACTORY(3, 4, 5, _t2_3)
+PWC_ISR_FACTORY(3, 5, 7, _t2_3)
 
 /**
  * The ISR for Capture/Compare overflow events.
  *
- * It simply increases overflows, which is used by
- * hsk_pwc_channel_getSum() to check whether the capture time window was
- * left.
+ * It increases overflows, which is used to check whether the capture time
+ * window was left.
+ *
+ * Channels without capture events for longer than their timeout are
+ * stalled. For every window time a stalled channel receives the longest
+ * measurable value, so frequencies decay towards 0. Once the buffer holds
+ * no more measurements the channel is invalidated.
  *
  * @private
  */
 void hsk_pwc_isr_cctOverflow(void) using 1 {
+	hsk_pwc_channel idata channel;
+	ubyte idata age;
+
 	overflows++;
+	for (channel = 0; channel < PWC_CHANNELS; channel++) {
+		/* Skip channels that were never opened or are invalid. */
+		if (!channels[channel].averageOver || channels[channel].invalid) {
+			continue;
+		}
+		/* Check for a stall. */
+		age = overflows - channels[channel].overflow;
+		if (age <= channels[channel].timeout) {
+			continue;
+		}
+		/* Decay. */
+		PWC_PUSH(channel, 0xffff);
+		/* Invalidate once all measurements are gone. */
+		if (age - channels[channel].timeout >= channels[channel].averageOver) {
+			channels[channel].invalid = channels[channel].averageOver + 1;
+		}
+	}
 }
 #pragma restore
 
 /**
  * This is the common implementation for soft capture events.
  *
+ * The overflow interrupt updates the channel data of stalled channels,
+ * so it is blocked along with the capture interrupts.
+ *
  * @param channel
  *	The channel that was captured.
  * @param capture
  *	The value that was captured.
  * @private
  */
-void hsk_pwc_ccn(const hsk_pwc_channel channel, uword capture) {
-	#define channel    channels[channel]
-	/* Get the new value and store the current capture value for next
-	 * time. */
-	capture -= channel.lastCapture;
-	channel.lastCapture += capture;
-	/* Update the sum and buffer. */
-	channel.sum -= channel.buffer[channel.pos];
-	channel.buffer[channel.pos++] = capture;
-	channel.pos %= channel.averageOver;
-	channel.sum += capture;
-	/* Update the overflow count.. */
-	channel.overflow = overflows;
-	/* Update the invalidation count. */
-	if (channel.invalid) {
-		channel.invalid--;
-	}
-	#undef channel
+void hsk_pwc_ccn(const hsk_pwc_channel channel, const uword capture) {
+	bool ea = EA;
+	bool exm = EXM;
+	bool et2 = ET2;
+
+	EA = 0;
+	EXM = 0;
+	ET2 = 0;
+	EA = ea;
+	PWC_CCN(channel, capture, capture);
+	EA = 0;
+	EXM = exm;
+	ET2 = et2;
+	EA = ea;
 }
 
 
@@ -451,15 +591,39 @@ void hsk_pwc_init(ulong window) {
 
 void hsk_pwc_channel_open(const hsk_pwc_channel channel,
                           ubyte __xdata averageOver) {
+	bool ea = EA;
+	bool exm = EXM;
+	bool et2 = ET2;
+
 	/*
 	 * Set up channel information.
 	 */
-	if (averageOver < 1 || averageOver > CHAN_BUF_SIZE) {
+	if (averageOver < 1) {
 		averageOver = 1;
 	}
+	if (averageOver > PWC_BUF_LEN(channel)) {
+		averageOver = PWC_BUF_LEN(channel);
+	}
+	/* Round down to a power of 2, so the ring position can be masked. */
+	while (averageOver & (averageOver - 1)) {
+		averageOver &= averageOver - 1;
+	}
+	/* Block the interrupts updating the channel. */
+	EA = 0;
+	EXM = 0;
+	ET2 = 0;
+	EA = ea;
 	memset(&channels[channel], 0, sizeof(channels[channel]));
+	memset(PWC_BUF(channel), 0, PWC_BUF_LEN(channel) * sizeof(uword));
+	memset(PWC_SORTED(channel), 0, PWC_SORT_LEN(channel) * sizeof(uword));
 	channels[channel].averageOver = averageOver;
+	channels[channel].averageOverConf = averageOver;
 	channels[channel].invalid = averageOver + 1;
+	channels[channel].timeout = 1;
+	EA = 0;
+	EXM = exm;
+	ET2 = et2;
+	EA = ea;
 
 	/**
 	 * Set the PWC capture mode.
@@ -736,6 +900,16 @@ void hsk_pwc_channel_close(const hsk_pwc_channel channel) {
 
 void hsk_pwc_channel_edgeMode(const hsk_pwc_channel channel,
                               const ubyte edgeMode) {
+	/*
+	 * The sorting filter modes cannot handle alternating high and
+	 * low pulses.
+	 */
+	channels[channel].edge = edgeMode;
+	if (edgeMode == PWC_EDGE_BOTH
+	    && channels[channel].filter != PWC_FILTER_MEAN) {
+		hsk_pwc_channel_filterMode(channel, PWC_FILTER_MEAN);
+	}
+
 	/*
 	 * Configure the corresponding external interrupt to trigger with
 	 * the desired edge.
@@ -768,6 +942,69 @@ void hsk_pwc_channel_captureMode(const hsk_pwc_channel channel,
 	SFR_PAGE(_t2_0, noSST);
 }
 
+bool hsk_pwc_channel_filterMode(const hsk_pwc_channel channel,
+                                const ubyte filterMode) {
+	bool ea = EA;
+	bool exm = EXM;
+	bool et2 = ET2;
+	ubyte averageOver = channels[channel].averageOverConf;
+
+	/* Sorting high and low pulses together is meaningless. */
+	if (filterMode != PWC_FILTER_MEAN
+	    && channels[channel].edge == PWC_EDGE_BOTH) {
+		return 0;
+	}
+
+	/* Limit the effort of keeping the buffer sorted. */
+	if (filterMode != PWC_FILTER_MEAN && averageOver > PWC_SORT_SIZE) {
+		averageOver = PWC_SORT_SIZE;
+	}
+
+	/* Block the interrupts updating the channel. */
+	EA = 0;
+	EXM = 0;
+	ET2 = 0;
+	EA = ea;
+
+	/* Discard the buffer contents. */
+	memset(PWC_BUF(channel), 0, PWC_BUF_LEN(channel) * sizeof(uword));
+	memset(PWC_SORTED(channel), 0, PWC_SORT_LEN(channel) * sizeof(uword));
+	channels[channel].sum = 0;
+	channels[channel].pos = 0;
+	channels[channel].averageOver = averageOver;
+	channels[channel].invalid = averageOver + 1;
+	channels[channel].filter = filterMode;
+
+	EA = 0;
+	EXM = exm;
+	ET2 = et2;
+	EA = ea;
+	return 1;
+}
+
+void hsk_pwc_channel_timeout(const hsk_pwc_channel channel,
+                             ubyte timeout) {
+	bool ea = EA;
+	bool et2 = ET2;
+
+	/* Keep the capture age from wrapping before the decay is
+	 * complete. */
+	if (timeout < 1) {
+		timeout = 1;
+	}
+	if (timeout > 0xff - PWC_BUF_LEN(channel)) {
+		timeout = 0xff - PWC_BUF_LEN(channel);
+	}
+
+	EA = 0;
+	ET2 = 0;
+	EA = ea;
+	channels[channel].timeout = timeout;
+	EA = 0;
+	ET2 = et2;
+	EA = ea;
+}
+
 void hsk_pwc_channel_trigger(const hsk_pwc_channel channel) {
 	switch (channel) {
 	case PWC_CC0:
@@ -813,33 +1050,44 @@ void hsk_pwc_disable(void) {
 	SFR_PAGE(_su0, noSST);
 }
 
+/**
+ * Applies the prescaler to a value and divides it by a power of 2.
+ *
+ * Both are combined into a single shift, so no intermediate result
+ * exceeds the final result.
+ *
+ * @param result
+ *	The ulong lvalue to store the result in
+ * @param value
+ *	The value to scale
+ * @param log2
+ *	The binary logarithm of the divisor
+ * @private
+ */
+#define PWC_SCALE(result, value, log2) { \
+	if (prescaler >= (log2)) { \
+		MDU_SHL(result, value, prescaler - (log2)); \
+	} else { \
+		MDU_SHR(result, value, (log2) - prescaler); \
+	} \
+}
+
 ulong hsk_pwc_channel_getValue(const hsk_pwc_channel channel,
                                const ubyte unit) {
+	volatile uword xdata * const buffer = PWC_BUF(channel);
+	volatile uword xdata * const sorted = PWC_SORTED(channel);
 	#define channel    channels[channel]
-	ulong result;
+	ulong result, sum;
+	ubyte shift;
 	bool ea = EA;
 	bool exm = EXM;
 	bool et2 = ET2;
-	ubyte overflow;
 
-	/* Get the current timer data, make this quick. */
-	SFR_PAGE(_t2_1, noSST);
+	/* Block the interrupts updating the channel. */
 	EA = 0;
 	EXM = 0;
 	ET2 = 0;
 	EA = ea;
-	/* Get the age of the last capture event. */
-	overflow = overflows - channel.overflow;
-	/* Captures shortly before and after an overflow may have an off by
-	 * one overflow count. */
-	if (overflow && T2CCU_CCTLH < (channel.lastCapture - 0x100)) {
-		overflow--;
-	}
-	/* Check whether the window time frame has been left. */
-	if (overflow) {
-		channel.invalid = channel.averageOver + 1;
-	}
-	SFR_PAGE(_t2_0, noSST);
 	/* Return 0 for invalid channels. */
 	if (channel.invalid) {
 		EA = 0;
@@ -849,88 +1097,123 @@ ulong hsk_pwc_channel_getValue(const hsk_pwc_channel channel,
 		return 0;
 	}
 
+	/*
+	 * Get the sum of the buffered values, the sorting filter modes
+	 * replace outliers with representative values.
+	 */
+	switch (channel.filter) {
+	case PWC_FILTER_MEDIAN:
+		MDU_MUL(sum, sorted[(channel.averageOver - 1) / 2],
+		        channel.averageOver);
+		MDU_MUL(result, sorted[channel.averageOver / 2],
+		        channel.averageOver);
+		sum = (sum + result) >> 1;
+		break;
+	case PWC_FILTER_TRIMMED:
+		if (channel.averageOver >= 4) {
+			sum = channel.sum - sorted[0]
+			      - sorted[channel.averageOver - 1];
+			MDU_DIV32(sum, sum * channel.averageOver,
+			          channel.averageOver - 2);
+			break;
+		}
+		/* Fall through to the average for small buffers. */
+	default:
+		sum = channel.sum;
+		break;
+	}
+
+	/* The number of buffered values is a power of 2, so the average
+	 * can be taken by shifting. */
+	for (shift = 0; (1 << shift) < channel.averageOver; shift++);
+
 	/*
 	 * Return the buffered values in the requested format.
 	 */
 	switch(unit) {
 	case PWC_UNIT_SUM_RAW:
-		result = channel.sum << prescaler;
+		MDU_SHL(result, sum, prescaler);
 		break;
 	case PWC_UNIT_WIDTH_RAW:
-		result = (channel.sum << prescaler)
-			/ channel.averageOver;
+		PWC_SCALE(result, sum, shift);
 		break;
 	case PWC_UNIT_WIDTH_NS:
-		result = (channel.sum << prescaler)
-			* 250 / 12 / channel.averageOver;
+		MDU_DIV32(result, sum * 125, 6);
+		PWC_SCALE(result, result, shift);
 		break;
 	case PWC_UNIT_WIDTH_US:
-		result = (channel.sum << prescaler)
-			/ 48 / channel.averageOver;
+		PWC_SCALE(result, sum, shift);
+		MDU_DIV32(result, result, 48);
 		break;
 	case PWC_UNIT_WIDTH_MS:
-		result = (channel.sum << prescaler)
-			/ 48000 / channel.averageOver;
+		PWC_SCALE(result, sum, shift);
+		MDU_DIV32(result, result, 48000);
 		break;
 	case PWC_UNIT_FREQ_S:
 		result = (48000000ul * channel.averageOver
-			/ channel.sum) >> prescaler;
+			/ sum) >> prescaler;
 		break;
 	case PWC_UNIT_FREQ_M:
 		result = ((48000000ul * 60) >> prescaler)
-			/ channel.sum * channel.averageOver;
+			/ sum * channel.averageOver;
 		break;
 	case PWC_UNIT_FREQ_H:
 		result = ((48000000ul * 60) >> prescaler)
-			/ channel.sum * 60 * channel.averageOver;
+			/ sum * 60 * channel.averageOver;
 		break;
 	case PWC_UNIT_DUTYH_RAW:
-		result = channel.buffer[(channel.pos + channel.averageOver
-		                         - 1 - channel.state)
-		                        % channel.averageOver]
-		         << prescaler;
+		MDU_SHL(result, buffer[(channel.pos + channel.averageOver
+		                        - 1 - channel.state)
+		                       & (channel.averageOver - 1)],
+		        prescaler);
 		break;
 	case PWC_UNIT_DUTYH_NS:
-		result = (channel.buffer[(channel.pos + channel.averageOver
-		                         - 1 - channel.state)
-		                        % channel.averageOver]
-		          << prescaler) * 250 / 12;
+		MDU_DIV32(result, (ulong)buffer[(channel.pos + channel.averageOver
+		                                 - 1 - channel.state)
+		                                & (channel.averageOver - 1)]
+		                  * 125, 6);
+		MDU_SHL(result, result, prescaler);
 		break;
 	case PWC_UNIT_DUTYH_US:
-		result = (channel.buffer[(channel.pos + channel.averageOver
-		                         - 1 - channel.state)
-		                        % channel.averageOver]
-		          << prescaler) / 48;
+		MDU_SHL(result, buffer[(channel.pos + channel.averageOver
+		                        - 1 - channel.state)
+		                       & (channel.averageOver - 1)],
+		        prescaler);
+		MDU_DIV32(result, result, 48);
 		break;
 	case PWC_UNIT_DUTYH_MS:
-		result = (channel.buffer[(channel.pos + channel.averageOver
-		                         - 1 - channel.state)
-		                        % channel.averageOver]
-		          << prescaler) / 48000;
+		MDU_SHL(result, buffer[(channel.pos + channel.averageOver
+		                        - 1 - channel.state)
+		                       & (channel.averageOver - 1)],
+		        prescaler);
+		MDU_DIV32(result, result, 48000);
 		break;
 	case PWC_UNIT_DUTYL_RAW:
-		result = channel.buffer[(channel.pos + channel.averageOver
-		                         - 1 - (channel.state ^ 1))
-		                        % channel.averageOver]
-		         << prescaler;
+		MDU_SHL(result, buffer[(channel.pos + channel.averageOver
+		                        - 1 - (channel.state ^ 1))
+		                       & (channel.averageOver - 1)],
+		        prescaler);
 		break;
 	case PWC_UNIT_DUTYL_NS:
-		result = (channel.buffer[(channel.pos + channel.averageOver
-		                         - 1 - (channel.state ^ 1))
-		                        % channel.averageOver]
-		          << prescaler) * 250 / 12;
+		MDU_DIV32(result, (ulong)buffer[(channel.pos + channel.averageOver
+		                                 - 1 - (channel.state ^ 1))
+		                                & (channel.averageOver - 1)]
+		                  * 125, 6);
+		MDU_SHL(result, result, prescaler);
 		break;
 	case PWC_UNIT_DUTYL_US:
-		result = (channel.buffer[(channel.pos + channel.averageOver
-		                         - 1 - (channel.state ^ 1))
-		                        % channel.averageOver]
-		          << prescaler) / 48;
+		MDU_SHL(result, buffer[(channel.pos + channel.averageOver
+		                        - 1 - (channel.state ^ 1))
+		                       & (channel.averageOver - 1)],
+		        prescaler);
+		MDU_DIV32(result, result, 48);
 		break;
 	case PWC_UNIT_DUTYL_MS:
-		result = (channel.buffer[(channel.pos + channel.averageOver
-		                         - 1 - (channel.state ^ 1))
-		                        % channel.averageOver]
-		          << prescaler) / 48000;
+		MDU_SHL(result, buffer[(channel.pos + channel.averageOver
+		                        - 1 - (channel.state ^ 1))
+		                       & (channel.averageOver - 1)],
+		        prescaler);
+		MDU_DIV32(result, result, 48000);
 		break;
 	default:
 		result = 0;
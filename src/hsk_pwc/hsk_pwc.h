@@ -11,13 +11,15 @@
  * hsk_pwc_init() and defines the time frame within which pulses can be
  * detected.
  *
- * If no pulse occurs during the window, the channel buffer is invalidated
- * and the hsk_pwc_channel_getValue() function will returns invalid (0) until
+ * If no pulse occurs for longer than the timeout of a channel, the channel
+ * is stalled. Every following window time a stalled channel receives the
+ * longest measurable pulse width, so the measured frequency decays.
+ * Once no more measurements are left, the channel buffer is invalidated
+ * and the hsk_pwc_channel_getValue() function will return invalid (0) until
  * the buffer is repopulated with valid measurements.
  *
- * In order to guarantee the detection of invalid channels, the
- * hsk_pwc_channel_getValue() function has to be called at least once every
- * 256 window times.
+ * The stall detection is performed by the capture timer overflow interrupt,
+ * so there is no need to poll channels.
  *
  * @author kami
  */
@@ -147,6 +149,22 @@ typedef ubyte hsk_pwc_port;
  */
 #define PWC_MODE_SOFT         3
 
+/**
+ * Filter mode, return the average of the buffered values.
+ */
+#define PWC_FILTER_MEAN       0
+
+/**
+ * Filter mode, return the median of the buffered values.
+ */
+#define PWC_FILTER_MEDIAN     1
+
+/**
+ * Filter mode, return the average of the buffered values, excluding the
+ * smallest and the largest value.
+ */
+#define PWC_FILTER_TRIMMED    2
+
 /**
  * This function initializes the T2CCU Capture/Compare Unit for capture mode.
  *
@@ -181,7 +199,9 @@ void hsk_pwc_init(ulong window);
  *	The PWC channel to open
  * @param averageOver
  *	The number of pulse values to average over when returning a
- *	value or speed. The value must be between 1 and 8.
+ *	value or speed. The value is limited to the buffer size of
+ *	the channel (PWC_BUF_SIZE, 8 by default) and rounded down to
+ *	a power of 2
  */
 void hsk_pwc_channel_open(const hsk_pwc_channel channel,
                           ubyte __xdata averageOver);
@@ -195,7 +215,9 @@ void hsk_pwc_channel_open(const hsk_pwc_channel channel,
  *	The input port to open
  * @param averageOver
  *	The number of pulse values to average over when returning a
- *	value or speed. The value must be between 1 and CHAN_BUF_SIZE
+ *	value or speed. The value is limited to the buffer size of
+ *	the channel (PWC_BUF_SIZE, 8 by default) and rounded down to
+ *	a power of 2
  */
 void hsk_pwc_port_open(const hsk_pwc_port port,
                        ubyte __xdata averageOver);
@@ -213,6 +235,9 @@ void hsk_pwc_channel_close(const hsk_pwc_channel channel);
  *
  * Available edges are specified in the PWC_EDGE_* defines.
  *
+ * Selecting \ref PWC_EDGE_BOTH returns the channel to
+ * \ref PWC_FILTER_MEAN, see hsk_pwc_channel_filterMode().
+ *
  * @param channel
  *	The channel to configure the edge for.
  * @param edgeMode
@@ -235,6 +260,64 @@ void hsk_pwc_channel_edgeMode(const hsk_pwc_channel channel,
 void hsk_pwc_channel_captureMode(const hsk_pwc_channel channel,
                                  const ubyte captureMode);
 
+/**
+ * Selects how buffered values are combined by hsk_pwc_channel_getValue().
+ *
+ * Available modes are specified in the PWC_FILTER_* defines.
+ * PWC_FILTER_MEAN is the default.
+ *
+ * The PWC_FILTER_MEDIAN and PWC_FILTER_TRIMMED modes reject outliers,
+ * such as short pulses caused by noise. The capture interrupt keeps
+ * a sorted copy of the buffer for these modes, which takes time linear
+ * to the averageOver value. Thus averageOver is reduced to
+ * PWC_SORT_SIZE (8 by default), if greater. Returning to
+ * PWC_FILTER_MEAN restores the averageOver value of the channel.
+ *
+ * The buffer contents are discarded, so the channel is invalid until it
+ * has been repopulated.
+ *
+ * Sorted buffers only make sense when all values represent the same kind
+ * of pulse. So the sorting modes are refused while the channel uses
+ * \ref PWC_EDGE_BOTH, which is the default set by
+ * hsk_pwc_channel_open(). Select \ref PWC_EDGE_RISING or
+ * \ref PWC_EDGE_FALLING with hsk_pwc_channel_edgeMode() first.
+ * The PWC_FILTER_TRIMMED mode falls back to the average if the channel
+ * averages over less than 4 values.
+ *
+ * @param channel
+ *	The channel to configure
+ * @param filterMode
+ *	The filter mode to set the channel to
+ * @retval 1
+ *	The filter mode was set
+ * @retval 0
+ *	A sorting mode was refused, because the channel captures both
+ *	edges
+ */
+bool hsk_pwc_channel_filterMode(const hsk_pwc_channel channel,
+                                const ubyte filterMode);
+
+/**
+ * Sets the number of window times without a pulse, after which a channel
+ * is considered stalled.
+ *
+ * The default timeout set by hsk_pwc_channel_open() is 1, which is the
+ * shortest possible timeout. Longer timeouts keep the last measurements
+ * for a while, e.g. to bridge gaps in the input signal.
+ *
+ * Pulses longer than the window time are never measured, regardless of
+ * the timeout. Such a pulse invalidates the channel until the buffer has
+ * been repopulated.
+ *
+ * @param channel
+ *	The channel to configure
+ * @param timeout
+ *	The timeout in window times, the maximum is 255 minus the
+ *	buffer size of the channel
+ */
+void hsk_pwc_channel_timeout(const hsk_pwc_channel channel,
+                             ubyte timeout);
+
 /**
  * Triggers a channel in soft trigger mode.
  *
@@ -268,7 +351,8 @@ void hsk_pwc_disable(void);
  *
  * This is the sum of the buffered values, not the average.
  *
- * Use this if precision is of the utmost importance.
+ * Use this if precision is of the utmost importance. The sum may exceed
+ * 32 bits for window times above ~1398ms when averaging over 64 values.
  */
 #define PWC_UNIT_SUM_RAW      0
 
@@ -287,6 +371,8 @@ void hsk_pwc_disable(void);
 
 /**
  * Average of buffered pulse widths in multiples of \f$ 10^{-9} s \f$.
+ *
+ * Pulse widths above ~4295ms cannot be represented.
  */
 #define PWC_UNIT_WIDTH_NS     2
 
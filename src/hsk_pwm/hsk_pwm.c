@@ -15,6 +15,13 @@
 
 #include "hsk_pwm.h"
 
+#include "../hsk_mdu/hsk_mdu.h"
+
+/**
+ * SYSCON0 Special Function Register Map Control bit.
+ */
+#define BIT_RMAP       0
+
 /**
  * CR_MISC CCU6 Clock Configuration bit.
  */
@@ -30,6 +37,17 @@
  */
 #define CNT_TnCLK      4
 
+/**
+ * CCU6_TCTR0L/CCU6_TCTR0H Timer T12/T13 Input Clock Select and Prescaler
+ * mask.
+ */
+#define MSK_TnCLK      (((1 << CNT_TnCLK) - 1) << BIT_TnCLK)
+
+/**
+ * CCU6_TCTR0L Timer T12 Center-Aligned Mode bit.
+ */
+#define BIT_CTM        7
+
 /**
  * PSLR Compare Outputs Passive State Level bits.
  */
@@ -72,12 +90,55 @@
  */
 #define MOD_MSEL6n     0x3
 
+/**
+ * CCU6_INPH Interrupt Node Pointer for Timer T12 Interrupts bits.
+ */
+#define BIT_INPT12     2
+
+/**
+ * CCU6_INPH Interrupt Node Pointer for Timer T13 Interrupts bits.
+ */
+#define BIT_INPT13     4
+
+/**
+ * INPT12/INPT13 bit count.
+ */
+#define CNT_INPTn      2
+
 /**
  * CCU6_TCTR4L/CCU6_TCTR4H Timer T12/T13 Shadow Transfer Request bit.
  */
 #define BIT_TnSTR      6
 
+/**
+ * CCU6_TCTR4L/CCU6_TCTR4H Timer T12/T13 Shadow Transfer Disable bit.
+ */
+#define BIT_TnSTD      7
+
+/**
+ * The periods index of timer T12.
+ */
+#define T12            0
+
+/**
+ * The periods index of timer T13.
+ */
+#define T13            1
+
+/** \var periods
+ * The T12 and T13 period register values.
+ *
+ * Keeping a copy saves reading them from a different SFR page when
+ * scaling duty cycles.
+ */
+static uword pdata periods[2];
+
 void hsk_pwm_init(const hsk_pwm_channel channel, const ulong freq) {
+	hsk_pwm_initMode(channel, freq, PWM_MODE_EDGE);
+}
+
+void hsk_pwm_initMode(const hsk_pwm_channel channel, const ulong freq,
+                      const ubyte mode) {
 	/**
 	 * <b>PWM Timings</b>
 	 *
@@ -101,27 +162,44 @@ void hsk_pwm_init(const hsk_pwm_channel channel, const ulong freq) {
 	 * be configured. Very high values degrade the precision, e.g. 96kHz
 	 * will only offer 1/500 precision.
 	 * The freq value 0 will result in ~0.02Hz (\f$48000000 / 2^{31}\f$).
+	 *
+	 * In center-aligned mode T12 counts up and down, so a PWM cycle
+	 * takes two timer periods.
 	 */
 
+	/* Center-aligned mode is only supported by T12. */
+	bool center = mode == PWM_MODE_CENTER && channel != PWM_63;
 	/* The clock prescaller in powers of 2. */
 	ubyte prescaler = 0;
 	/* The period required to reach the frequency with the current
 	 * prescaler. The highest value below or equal 2^16 offers the
 	 * highest precision. */
-	ulong xdata period = 480000000ul / (freq > 0 ? freq : 1ul);
+	ulong xdata period;
 
-	/* Special case, get the slowest frequency possible. */
 	if (freq == 0) {
+		/* Special case, get the slowest frequency possible. */
 		period = 1ul << 16;
 		prescaler = 15;
+	} else if (freq < (1ul << 16)) {
+		MDU_DIV32(period, 480000000ul, freq);
+	} else {
+		period = 480000000ul / freq;
+	}
+
+	/* Halve the period in center-aligned mode. */
+	if (center) {
+		period >>= 1;
 	}
 
 	/*
 	 * All factors considered the clock can be divided by up to 2^15.
 	 * This loop calculates the smallest division factor that can be
 	 * used.
+	 *
+	 * Halving the period is equivalent to dividing the halved clock
+	 * by freq, because floor(floor(a / b) / c) = floor(a / (b * c)).
 	 */
-	for (; period >= (1ul << 16) && prescaler <= 15; period = (480000000ul >> ++prescaler) / freq);
+	for (; period >= (1ul << 16) && prescaler <= 15; period >>= 1, ++prescaler);
 
 	/*
 	 * Set CCU6CLK to FCLK.
@@ -138,11 +216,12 @@ void hsk_pwm_init(const hsk_pwm_channel channel, const ulong freq) {
 	case PWM_60:
 	case PWM_61:
 	case PWM_62:
-		/* Set the timer T12 prescaler. */
-		CCU6_TCTR0L = (prescaler << BIT_TnCLK);
+		/* Set the timer T12 prescaler and counting mode. */
+		CCU6_TCTR0L = (prescaler << BIT_TnCLK) | ((ubyte)center << BIT_CTM);
 
 		/* Set the timer period. */
 		CCU6_T12PRLH = period - 1;
+		periods[T12] = period - 1;
 
 		SFR_PAGE(_cc2, noSST);
 		/*
@@ -156,6 +235,9 @@ void hsk_pwm_init(const hsk_pwm_channel channel, const ulong freq) {
 		/* Enable timer T12 output. */
 		CCU6_MODCTRL |= ((1 << CNT_TnMODEN) - 1) << BIT_TnMODEN;
 
+		/* Route the T12 interrupts to node 0 for duty cycle ramps. */
+		CCU6_INPH &= ~(((1 << CNT_INPTn) - 1) << BIT_INPT12);
+
 		/* Switch all the CC6n and COUT6n channels to output mode. */
 		CCU6_T12MSELL = MOD_MSEL6n << CNT_MSEL6n | MOD_MSEL6n;
 		CCU6_T12MSELH = CCU6_T12MSELH & ~((1 << CNT_MSEL6n) - 1) | MOD_MSEL6n;
@@ -177,6 +259,7 @@ void hsk_pwm_init(const hsk_pwm_channel channel, const ulong freq) {
 
 		/* Set the timer period. */
 		CCU6_T13PRLH = period - 1;
+		periods[T13] = period - 1;
 
 		SFR_PAGE(_cc2, noSST);
 		/*
@@ -190,6 +273,9 @@ void hsk_pwm_init(const hsk_pwm_channel channel, const ulong freq) {
 		/* Enable timer T13 output. */
 		CCU6_MODCTRH |= 1 << BIT_ECT13O;
 
+		/* Route the T13 interrupts to node 0 for duty cycle ramps. */
+		CCU6_INPH &= ~(((1 << CNT_INPTn) - 1) << BIT_INPT13);
+
 		/*
 		 * Make sure the PWM comes up clean by setting all duty cycles to 0.
 		 */
@@ -202,6 +288,32 @@ void hsk_pwm_init(const hsk_pwm_channel channel, const ulong freq) {
 	}
 }
 
+void hsk_pwm_setFrequency(const hsk_pwm_channel channel,
+                          const ulong config) {
+	ubyte prescaler = (ubyte)(config >> 16) << BIT_TnCLK;
+	uword period = config;
+
+	SFR_PAGE(_cc1, noSST);
+	if (channel == PWM_63) {
+		/* Changing the prescaler takes effect immediately. */
+		if ((CCU6_TCTR0H & MSK_TnCLK) != prescaler) {
+			CCU6_TCTR0H = CCU6_TCTR0H & ~MSK_TnCLK | prescaler;
+		}
+		CCU6_T13PRLH = period;
+		periods[T13] = period;
+		SFR_PAGE(_cc0, noSST);
+		CCU6_TCTR4H = 1 << BIT_TnSTR;
+	} else {
+		if ((CCU6_TCTR0L & MSK_TnCLK) != prescaler) {
+			CCU6_TCTR0L = CCU6_TCTR0L & ~MSK_TnCLK | prescaler;
+		}
+		CCU6_T12PRLH = period;
+		periods[T12] = period;
+		SFR_PAGE(_cc0, noSST);
+		CCU6_TCTR4L = 1 << BIT_TnSTR;
+	}
+}
+
 /** \var ports
  * Data structure to hold output port configurations.
  */
@@ -360,7 +472,8 @@ void hsk_pwm_channel_set(const hsk_pwm_channel channel,
 	switch (channel) {
 	case PWM_60:
 		/* Calculate the duty cycle. */
-		duty = (ulong)(CCU6_T12PRLH + 1) * value / max;
+		MDU_MUL(duty, CCU6_T12PRLH + 1, value);
+		MDU_DIV32(duty, duty, max);
 		/* Write the duty cycle. */
 		SFR_PAGE(_cc0, noSST);
 		CCU6_CC60SRLH = duty;
@@ -368,7 +481,8 @@ void hsk_pwm_channel_set(const hsk_pwm_channel channel,
 		break;
 	case PWM_61:
 		/* Calculate the duty cycle. */
-		duty = (ulong)(CCU6_T12PRLH + 1) * value / max;
+		MDU_MUL(duty, CCU6_T12PRLH + 1, value);
+		MDU_DIV32(duty, duty, max);
 		/* Write the duty cycle. */
 		SFR_PAGE(_cc0, noSST);
 		CCU6_CC61SRLH = duty;
@@ -376,7 +490,8 @@ void hsk_pwm_channel_set(const hsk_pwm_channel channel,
 		break;
 	case PWM_62:
 		/* Calculate the duty cycle. */
-		duty = (ulong)(CCU6_T12PRLH + 1) * value / max;
+		MDU_MUL(duty, CCU6_T12PRLH + 1, value);
+		MDU_DIV32(duty, duty, max);
 		/* Write the duty cycle. */
 		SFR_PAGE(_cc0, noSST);
 		CCU6_CC62SRLH = duty;
@@ -384,7 +499,8 @@ void hsk_pwm_channel_set(const hsk_pwm_channel channel,
 		break;
 	case PWM_63:
 		/* Calculate the duty cycle. */
-		duty = (ulong)(CCU6_T13PRLH + 1) * value / max;
+		MDU_MUL(duty, CCU6_T13PRLH + 1, value);
+		MDU_DIV32(duty, duty, max);
 		/* Write the duty cycle. */
 		SFR_PAGE(_cc0, noSST);
 		CCU6_CC63SRLH = duty;
@@ -393,6 +509,248 @@ void hsk_pwm_channel_set(const hsk_pwm_channel channel,
 	}
 }
 
+/**
+ * Scales a duty cycle to a compare value.
+ *
+ * @param period
+ *	The period register value of the timer
+ * @param duty
+ *	The duty cycle from 0 to \ref PWM_DUTY_MAX
+ * @return
+ *	The compare value
+ * @private
+ */
+static uword hsk_pwm_scale(const uword period, const uword duty) {
+	ulong compare;
+
+	/* (period + 1) * duty / PWM_DUTY_MAX, without overflowing period. */
+	MDU_MUL(compare, period, duty);
+	compare = (compare + duty) >> PWM_DUTY_BITS;
+	return compare > 0xffff ? 0xffff : compare;
+}
+
+void hsk_pwm_channel_setDuty(const hsk_pwm_channel channel,
+                             const uword duty) {
+	uword compare;
+
+	/* Set the new cycle and request shadow transfer. */
+	switch (channel) {
+	case PWM_60:
+		compare = hsk_pwm_scale(periods[T12], duty);
+		SFR_PAGE(_cc0, noSST);
+		CCU6_CC60SRLH = compare;
+		CCU6_TCTR4L = 1 << BIT_TnSTR;
+		break;
+	case PWM_61:
+		compare = hsk_pwm_scale(periods[T12], duty);
+		SFR_PAGE(_cc0, noSST);
+		CCU6_CC61SRLH = compare;
+		CCU6_TCTR4L = 1 << BIT_TnSTR;
+		break;
+	case PWM_62:
+		compare = hsk_pwm_scale(periods[T12], duty);
+		SFR_PAGE(_cc0, noSST);
+		CCU6_CC62SRLH = compare;
+		CCU6_TCTR4L = 1 << BIT_TnSTR;
+		break;
+	case PWM_63:
+		compare = hsk_pwm_scale(periods[T13], duty);
+		SFR_PAGE(_cc0, noSST);
+		CCU6_CC63SRLH = compare;
+		CCU6_TCTR4H = 1 << BIT_TnSTR;
+		break;
+	}
+}
+
+void hsk_pwm_channels_set(const uword duty60, const uword duty61,
+                          const uword duty62) {
+	uword cc60 = hsk_pwm_scale(periods[T12], duty60);
+	uword cc61 = hsk_pwm_scale(periods[T12], duty61);
+	uword cc62 = hsk_pwm_scale(periods[T12], duty62);
+
+	SFR_PAGE(_cc0, noSST);
+	/*
+	 * Withdraw pending shadow transfer requests, so the transfer
+	 * cannot happen while only some of the values are written.
+	 */
+	CCU6_TCTR4L = 1 << BIT_TnSTD;
+	CCU6_CC60SRLH = cc60;
+	CCU6_CC61SRLH = cc61;
+	CCU6_CC62SRLH = cc62;
+	/* Take over all values with a single shadow transfer. */
+	CCU6_TCTR4L = 1 << BIT_TnSTR;
+}
+
+/** \var ramps
+ * Duty cycle ramp states of all channels.
+ */
+static volatile struct {
+	/**
+	 * The current compare value with 8 fraction bits.
+	 */
+	ulong current;
+
+	/**
+	 * The target compare value.
+	 */
+	uword target;
+
+	/**
+	 * The compare value change per period with 8 fraction bits, 0 if
+	 * the ramp is complete.
+	 */
+	uword step;
+} pdata ramps[4];
+
+/**
+ * IRCON3 Interrupt Flag for CCU6 Interrupt Node 0 bit.
+ */
+#define BIT_CCU6SR0    1
+
+/**
+ * CCU6_ISL/CCU6_ISRL/CCU6_IENL T12 Period Match bit.
+ */
+#define BIT_T12PM      7
+
+/**
+ * CCU6_ISH/CCU6_ISRH/CCU6_IENH T13 Period Match bit.
+ */
+#define BIT_T13PM      1
+
+/**
+ * Advances a duty cycle ramp by one step.
+ *
+ * The ISR passes constant channels, which allows the compiler to
+ * address the ramp data directly.
+ *
+ * @param chan
+ *	The channel to advance
+ * @param reg
+ *	The shadow register to write the new compare value to
+ * @private
+ */
+#define PWM_RAMP(chan, reg) { \
+	if (ramps[chan].step) { \
+		if (ramps[chan].current < ((ulong)ramps[chan].target << 8)) { \
+			ramps[chan].current += ramps[chan].step; \
+			if (ramps[chan].current >= ((ulong)ramps[chan].target << 8)) { \
+				ramps[chan].current = (ulong)ramps[chan].target << 8; \
+				ramps[chan].step = 0; \
+			} \
+		} else if (ramps[chan].current - ((ulong)ramps[chan].target << 8) > ramps[chan].step) { \
+			ramps[chan].current -= ramps[chan].step; \
+		} else { \
+			ramps[chan].current = (ulong)ramps[chan].target << 8; \
+			ramps[chan].step = 0; \
+		} \
+		reg = ramps[chan].current >> 8; \
+	} \
+}
+
+/**
+ * Advances the duty cycle ramps upon T12 and T13 period matches.
+ *
+ * The period match interrupts are turned off when all ramps of a timer
+ * are complete.
+ *
+ * @private
+ */
+void ISR_hsk_pwm(void) interrupt 10 using 1 {
+	bool rmap = (SYSCON0 >> BIT_RMAP) & 1;
+	RESET_RMAP();
+
+	SFR_PAGE(_su3, SST0);
+	IRCON3 &= ~(1 << BIT_CCU6SR0);
+	SFR_PAGE(_su3, RST0);
+
+	SFR_PAGE(_cc3, SST0);
+	if (CCU6_ISL & (1 << BIT_T12PM)) {
+		SFR_PAGE(_cc0, noSST);
+		CCU6_ISRL = 1 << BIT_T12PM;
+		if (ramps[PWM_60].step || ramps[PWM_61].step || ramps[PWM_62].step) {
+			PWM_RAMP(PWM_60, CCU6_CC60SRLH);
+			PWM_RAMP(PWM_61, CCU6_CC61SRLH);
+			PWM_RAMP(PWM_62, CCU6_CC62SRLH);
+			CCU6_TCTR4L = 1 << BIT_TnSTR;
+		}
+		if (!ramps[PWM_60].step && !ramps[PWM_61].step && !ramps[PWM_62].step) {
+			SFR_PAGE(_cc2, noSST);
+			CCU6_IENL &= ~(1 << BIT_T12PM);
+		}
+		SFR_PAGE(_cc3, noSST);
+	}
+	if (CCU6_ISH & (1 << BIT_T13PM)) {
+		SFR_PAGE(_cc0, noSST);
+		CCU6_ISRH = 1 << BIT_T13PM;
+		if (ramps[PWM_63].step) {
+			PWM_RAMP(PWM_63, CCU6_CC63SRLH);
+			CCU6_TCTR4H = 1 << BIT_TnSTR;
+		}
+		if (!ramps[PWM_63].step) {
+			SFR_PAGE(_cc2, noSST);
+			CCU6_IENH &= ~(1 << BIT_T13PM);
+		}
+	}
+	SFR_PAGE(_cc0, RST0);
+
+	rmap ? (SET_RMAP()) : (RESET_RMAP());
+}
+
+void hsk_pwm_channel_ramp(const hsk_pwm_channel channel,
+                          const uword duty, const uword slope) {
+	bool ea = EA;
+	uword period = channel == PWM_63 ? periods[T13] : periods[T12];
+	uword target = hsk_pwm_scale(period, duty);
+	uword step = hsk_pwm_scale(period, slope);
+
+	/* Make sure the ramp progresses. */
+	if (!step) {
+		step = 1;
+	}
+
+	EA = 0;
+	ECCIP0 = 0;
+	EA = ea;
+
+	/* Start from the current compare value. */
+	if (!ramps[channel].step) {
+		SFR_PAGE(_cc0, noSST);
+		switch (channel) {
+		case PWM_60:
+			ramps[channel].current = (ulong)CCU6_CC60SRLH << 8;
+			break;
+		case PWM_61:
+			ramps[channel].current = (ulong)CCU6_CC61SRLH << 8;
+			break;
+		case PWM_62:
+			ramps[channel].current = (ulong)CCU6_CC62SRLH << 8;
+			break;
+		case PWM_63:
+			ramps[channel].current = (ulong)CCU6_CC63SRLH << 8;
+			break;
+		}
+	}
+	ramps[channel].target = target;
+	ramps[channel].step = step;
+
+	/* Activate the period match interrupt. */
+	SFR_PAGE(_cc2, noSST);
+	if (channel == PWM_63) {
+		CCU6_IENH |= 1 << BIT_T13PM;
+	} else {
+		CCU6_IENL |= 1 << BIT_T12PM;
+	}
+	SFR_PAGE(_cc0, noSST);
+
+	EA = 0;
+	ECCIP0 = 1;
+	EA = ea;
+}
+
+bool hsk_pwm_channel_ramping(const hsk_pwm_channel channel) {
+	return ramps[channel].step != 0;
+}
+
 void hsk_pwm_outChannel_dir(hsk_pwm_outChannel channel,
                             const bool up) {
 	/* The configuration bit for COUT63 is misplaced. */
@@ -406,6 +764,55 @@ void hsk_pwm_outChannel_dir(hsk_pwm_outChannel channel,
 	SFR_PAGE(_cc0, noSST);
 }
 
+/**
+ * The maximum dead-time in T12 clock cycles.
+ */
+#define DTM_MAX        0xff
+
+void hsk_pwm_deadTime(const uword deadTime) {
+	ubyte prescaler;
+	ulong ticks;
+
+	SFR_PAGE(_cc1, noSST);
+	prescaler = (CCU6_TCTR0L & MSK_TnCLK) >> BIT_TnCLK;
+
+	/* Round up, so the dead-time is never shortened. */
+	ticks = ((ulong)deadTime + (1ul << prescaler) - 1) >> prescaler;
+	CCU6_T12DTCL = ticks > DTM_MAX ? DTM_MAX : ticks;
+	SFR_PAGE(_cc0, noSST);
+}
+
+/**
+ * CCU6_T12DTCH Dead-Time Enable bits.
+ */
+#define BIT_DTE0       0
+
+void hsk_pwm_channel_complementary(const hsk_pwm_channel channel,
+                                   const bool enable) {
+	/* The PSLR bits of CC6x and COUT6x. */
+	ubyte psl = 0x3 << (channel << 1);
+
+	if (channel == PWM_63) {
+		return;
+	}
+
+	if (enable) {
+		/* Both outputs active high, i.e. low during the dead-time. */
+		SFR_PAGE(_cc2, noSST);
+		CCU6_PSLR &= ~psl;
+		/* Enable dead-time generation. */
+		SFR_PAGE(_cc1, noSST);
+		CCU6_T12DTCH |= 1 << (BIT_DTE0 + channel);
+	} else {
+		/* Restore the init defaults. */
+		SFR_PAGE(_cc2, noSST);
+		CCU6_PSLR |= psl;
+		SFR_PAGE(_cc1, noSST);
+		CCU6_T12DTCH &= ~(1 << (BIT_DTE0 + channel));
+	}
+	SFR_PAGE(_cc0, noSST);
+}
+
 /**
  * PMCON1 Capture Compare Unit Disable bit.
  */
@@ -28,12 +28,32 @@
  * - hsk_pwm_enable()
  * - hsk_pwm_port_open()
  *
+ * To drive half-bridges the T12 channels can be operated center-aligned,
+ * with complementary CC6x and COUT6x outputs and hardware dead-time
+ * insertion. The boot order for this is:
+ * - hsk_pwm_initMode()
+ * - hsk_pwm_deadTime()
+ * - hsk_pwm_channel_complementary()
+ * - hsk_pwm_enable()
+ * - hsk_pwm_port_open()
+ *
+ * Duty cycles can be ramped towards a target in the background, using
+ * the period match interrupt of the driving timer. This interrupt
+ * is handled by CCU6 interrupt node 0 (interrupt 10).
+ *
  * @author kami
  */
 
 #ifndef _HSK_PWM_H_
 #define _HSK_PWM_H_
 
+/*
+ * ISR prototypes for SDCC.
+ */
+#ifdef SDCC
+#include "hsk_pwm.isr"
+#endif /* SDCC */
+
 /**
  * Type definition for PWM channels.
  */
@@ -204,6 +224,83 @@ typedef ubyte hsk_pwm_port;
  */
 #define PWM_OUT_63_P43    19
 
+/**
+ * The number of fraction bits of duty cycles passed to
+ * hsk_pwm_channel_setDuty() and hsk_pwm_channels_set().
+ */
+#define PWM_DUTY_BITS     15
+
+/**
+ * The duty cycle value representing 100%.
+ */
+#define PWM_DUTY_MAX      (1u << PWM_DUTY_BITS)
+
+/**
+ * Edge-aligned PWM mode, the timer counts up and restarts from 0.
+ */
+#define PWM_MODE_EDGE     0
+
+/**
+ * Center-aligned PWM mode, the timer counts up and down.
+ *
+ * Only available for the T12 driven channels.
+ */
+#define PWM_MODE_CENTER   1
+
+/**
+ * Returns the unscaled timer period for a PWM frequency.
+ *
+ * @param freq
+ *	The PWM cycle frequency in units of 0.1Hz, must not be 0
+ * @private
+ */
+#define PWM_FREQ_PERIOD(freq) \
+	(480000000ul / (freq))
+
+/**
+ * Returns the smallest clock prescaler that allows representing the
+ * timer period for a PWM frequency in 16 bits.
+ *
+ * @param freq
+ *	The PWM cycle frequency in units of 0.1Hz, must not be 0
+ * @private
+ */
+#define PWM_FREQ_PRESCALER(freq) ( \
+	 PWM_FREQ_PERIOD(freq) >>  0 < (1ul << 16) ?  0 : \
+	 PWM_FREQ_PERIOD(freq) >>  1 < (1ul << 16) ?  1 : \
+	 PWM_FREQ_PERIOD(freq) >>  2 < (1ul << 16) ?  2 : \
+	 PWM_FREQ_PERIOD(freq) >>  3 < (1ul << 16) ?  3 : \
+	 PWM_FREQ_PERIOD(freq) >>  4 < (1ul << 16) ?  4 : \
+	 PWM_FREQ_PERIOD(freq) >>  5 < (1ul << 16) ?  5 : \
+	 PWM_FREQ_PERIOD(freq) >>  6 < (1ul << 16) ?  6 : \
+	 PWM_FREQ_PERIOD(freq) >>  7 < (1ul << 16) ?  7 : \
+	 PWM_FREQ_PERIOD(freq) >>  8 < (1ul << 16) ?  8 : \
+	 PWM_FREQ_PERIOD(freq) >>  9 < (1ul << 16) ?  9 : \
+	 PWM_FREQ_PERIOD(freq) >> 10 < (1ul << 16) ? 10 : \
+	 PWM_FREQ_PERIOD(freq) >> 11 < (1ul << 16) ? 11 : \
+	 PWM_FREQ_PERIOD(freq) >> 12 < (1ul << 16) ? 12 : \
+	 PWM_FREQ_PERIOD(freq) >> 13 < (1ul << 16) ? 13 : \
+	 PWM_FREQ_PERIOD(freq) >> 14 < (1ul << 16) ? 14 : \
+	 15)
+
+/**
+ * Creates a PWM frequency configuration for hsk_pwm_setFrequency().
+ *
+ * This performs the same calculation as hsk_pwm_init() at compile time,
+ * if freq is a constant.
+ *
+ * The configuration holds the clock prescaler in the upper 16 bits and
+ * the period register value in the lower 16 bits.
+ *
+ * @param freq
+ *	The PWM cycle frequency in units of 0.1Hz, from 1 to 4800000
+ * @return
+ *	A configuration for hsk_pwm_setFrequency()
+ */
+#define PWM_FREQ(freq) \
+	((ulong)PWM_FREQ_PRESCALER(freq) << 16 \
+	 | (PWM_FREQ_PERIOD(freq) >> PWM_FREQ_PRESCALER(freq)) - 1)
+
 /**
  * Sets up the the CCU6 timer frequencies that control the PWM
  * cycle.
@@ -234,6 +331,90 @@ typedef ubyte hsk_pwm_port;
  */
 void hsk_pwm_init(const hsk_pwm_channel channel, const ulong freq);
 
+/**
+ * Sets up the CCU6 timer frequencies and the counting mode.
+ *
+ * This works like hsk_pwm_init(), which always selects
+ * \ref PWM_MODE_EDGE.
+ *
+ * In \ref PWM_MODE_CENTER the T12 timer counts up and down, so the
+ * pulses of all T12 channels are centered around the same point in time.
+ * The timer runs at twice the requested frequency to compensate, which
+ * halves the precision.
+ *
+ * PWM_63 only supports \ref PWM_MODE_EDGE, the mode argument is ignored
+ * for this channel.
+ *
+ * @param channel
+ *	The channel to change the frequency for
+ * @param freq
+ *	The desired PWM cycle frequency in units of 0.1Hz
+ * @param mode
+ *	The counting mode, \ref PWM_MODE_EDGE or \ref PWM_MODE_CENTER
+ */
+void hsk_pwm_initMode(const hsk_pwm_channel channel, const ulong freq,
+                      const ubyte mode);
+
+/**
+ * Changes the PWM frequency of a running timer.
+ *
+ * The new period is written to the shadow register and becomes
+ * active with the next shadow transfer, i.e. at the end of the
+ * current PWM period. The clock prescaler is not shadowed by the
+ * hardware, if the configuration uses a different prescaler, the
+ * period the change takes place in is distorted.
+ *
+ * Compare values are not adjusted, the duty cycles should be set again
+ * right after calling this function, so they can be taken over by the
+ * same shadow transfer. Ramps must not be in progress.
+ *
+ * In \ref PWM_MODE_CENTER the PWM frequency is half the configured
+ * frequency, use PWM_FREQ(2 * freq).
+ *
+ * @param channel
+ *	The channel to change the frequency for
+ * @param config
+ *	The frequency configuration created with PWM_FREQ()
+ */
+void hsk_pwm_setFrequency(const hsk_pwm_channel channel,
+                          const ulong config);
+
+/**
+ * Sets the dead-time inserted between complementary outputs.
+ *
+ * The dead-time is shared by all T12 channels and only applies to
+ * channels set up with hsk_pwm_channel_complementary().
+ *
+ * The dead-time is counted with the T12 clock, it is rounded up to the
+ * T12 clock resolution and limited to 255 T12 clock cycles. Thus it
+ * must be set after hsk_pwm_init()/hsk_pwm_initMode().
+ *
+ * @param deadTime
+ *	The dead-time in CCU6 clock cycles of 1/48 µs
+ */
+void hsk_pwm_deadTime(const uword deadTime);
+
+/**
+ * Pairs the outputs of a T12 channel for half-bridge drive.
+ *
+ * In complementary mode COUT6x outputs the duty cycle, which is meant
+ * for the high side switch, and CC6x outputs its complement for the low
+ * side switch. Both outputs are active high and are held low for the
+ * dead-time, whenever one of them switches on.
+ *
+ * Turning complementary mode off restores the default passive levels,
+ * configurations made with hsk_pwm_outChannel_dir() are lost.
+ *
+ * This has no effect on PWM_63, which has no complementary output.
+ *
+ * @param channel
+ *	The PWM channel to configure, one of PWM_60, PWM_61 and PWM_62
+ * @param enable
+ *	Set 1 to activate complementary mode, 0 to deactivate it
+ */
+void hsk_pwm_channel_complementary(const hsk_pwm_channel channel,
+                                   const bool enable);
+
 /**
  * Set up a PWM output port.
  *
@@ -280,6 +461,77 @@ void hsk_pwm_port_close(const hsk_pwm_port port);
 void hsk_pwm_channel_set(const hsk_pwm_channel channel,
                          const uword max, const uword value);
 
+/**
+ * Set the duty cycle for the given channel in fixed point representation.
+ *
+ * This is a faster alternative to hsk_pwm_channel_set(), it does not
+ * require a division.
+ *
+ * @param channel
+ *	The PWM channel to set the duty cycle for, check the PWM_6x defines
+ * @param duty
+ *	The duty cycle from 0 to \ref PWM_DUTY_MAX
+ */
+void hsk_pwm_channel_setDuty(const hsk_pwm_channel channel,
+                             const uword duty);
+
+/**
+ * Set the duty cycles of all T12 driven channels at once.
+ *
+ * All three compare values are taken over by a single shadow transfer,
+ * so the new duty cycles become active in the same PWM period. This is
+ * required to drive multiple phases of a motor.
+ *
+ * PWM_63 is driven by T13, which has its own period and shadow transfer,
+ * use hsk_pwm_channel_setDuty() for it.
+ *
+ * @param duty60
+ *	The PWM_60 duty cycle from 0 to \ref PWM_DUTY_MAX
+ * @param duty61
+ *	The PWM_61 duty cycle from 0 to \ref PWM_DUTY_MAX
+ * @param duty62
+ *	The PWM_62 duty cycle from 0 to \ref PWM_DUTY_MAX
+ */
+void hsk_pwm_channels_set(const uword duty60, const uword duty61,
+                          const uword duty62);
+
+/**
+ * Ramp the duty cycle of the given channel towards a target value.
+ *
+ * The duty cycle is advanced once per PWM period by the period match
+ * interrupt, so ramps are not affected by the timing of the caller.
+ * The ramp starts from the current duty cycle of the channel, calling
+ * the function during a ramp changes the target and slope on the fly.
+ *
+ * The ramp is performed on compare values, so the step size is
+ * subject to the precision of the PWM period.
+ *
+ * Other functions setting the duty cycle of a channel must not be
+ * used while it is ramping.
+ *
+ * @param channel
+ *	The PWM channel to ramp the duty cycle for, check the PWM_6x defines
+ * @param duty
+ *	The target duty cycle from 0 to \ref PWM_DUTY_MAX
+ * @param slope
+ *	The duty cycle change per PWM period in 1/256 of
+ *	\ref PWM_DUTY_MAX based duty cycle units
+ */
+void hsk_pwm_channel_ramp(const hsk_pwm_channel channel,
+                          const uword duty, const uword slope);
+
+/**
+ * Returns whether a duty cycle ramp is in progress.
+ *
+ * @param channel
+ *	The PWM channel to check, check the PWM_6x defines
+ * @retval 1
+ *	The duty cycle has not reached the target, yet
+ * @retval 0
+ *	No ramp is active
+ */
+bool hsk_pwm_channel_ramping(const hsk_pwm_channel channel);
+
 /**
  * Set the direction of an output channel.
  *